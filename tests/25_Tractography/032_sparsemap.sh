@@ -0,0 +1,2 @@
+#@desc Checking that sparse visitation maps match dense ones
+${TRACTOR} sparse-map $TRACTOR_TEST_DATA/streamlines/wm2gm $TRACTOR_TEST_DATA/session/tractor/diffusion/dti_FA.nii.gz
@@ -0,0 +1,2 @@
+#@desc Checking that tractography results don't depend on the number of threads
+${TRACTOR} track-threads $TRACTOR_TEST_DATA/session 50 59 33 Threads:4
@@ -0,0 +1,2 @@
+#@desc Checking that seedwise median files with placeholders can be rewritten
+${TRACTOR} seedwise-median $TRACTOR_TEST_DATA/session 50 59 33
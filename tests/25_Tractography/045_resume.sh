@@ -0,0 +1,2 @@
+#@desc Checking that an interrupted tracking run can be resumed
+${TRACTOR} checkpoint-resume $TRACTOR_TEST_DATA/session 50 59 33
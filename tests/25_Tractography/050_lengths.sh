@@ -0,0 +1,2 @@
+#@desc Checking that streamline lengths don't depend on decoding
+${TRACTOR} streamline-lengths $TRACTOR_TEST_DATA/streamlines/wm2gm
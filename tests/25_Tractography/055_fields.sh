@@ -0,0 +1,2 @@
+#@desc Checking that streamline scalars and properties can be written and read back
+${TRACTOR} streamline-fields $TRACTOR_TEST_DATA/session $TRACTOR_TEST_DATA/streamlines/wm2gm
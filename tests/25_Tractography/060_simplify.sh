@@ -0,0 +1,2 @@
+#@desc Checking that simplified streamlines keep their seeds and stay within tolerance
+${TRACTOR} simplify-streamlines $TRACTOR_TEST_DATA/streamlines/wm2gm 0.5
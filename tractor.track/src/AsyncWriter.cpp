@@ -0,0 +1,103 @@
+#include <RcppEigen.h>
+
+#include "AsyncWriter.h"
+
+void AsyncWriter::run ()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        while (queue.empty() && !stopping)
+            condition.wait(lock);
+        if (queue.empty())
+            break;
+        
+        std::vector<char> buffer;
+        buffer.swap(queue.front());
+        queue.pop_front();
+        writing = true;
+        
+        // Release the lock while writing, so the producer can carry on
+        // encoding; once a write has failed, later data is dropped
+        const bool failed = !error.empty();
+        bool ok = true;
+        lock.unlock();
+        if (!failed)
+        {
+            stream->write(&buffer[0], buffer.size());
+            ok = !stream->fail();
+        }
+        buffer.clear();
+        lock.lock();
+        
+        if (!ok)
+            error = "Failed to write buffered data to file";
+        spares.push_back(std::vector<char>());
+        spares.back().swap(buffer);
+        writing = false;
+        condition.notify_all();
+    }
+}
+
+void AsyncWriter::checkError ()
+{
+    if (!error.empty())
+    {
+        const std::string message = error;
+        error.clear();
+        throw std::runtime_error(message);
+    }
+}
+
+void AsyncWriter::submit (std::vector<char> &buffer)
+{
+    if (buffer.empty())
+        return;
+    if (stream == NULL)
+        throw std::runtime_error("No stream is attached to the writer");
+    
+    std::unique_lock<std::mutex> lock(mutex);
+    checkError();
+    if (!thread.joinable())
+    {
+        stopping = false;
+        thread = std::thread(&AsyncWriter::run, this);
+    }
+    
+    while (queue.size() >= maxPending)
+        condition.wait(lock);
+    
+    queue.push_back(std::vector<char>());
+    queue.back().swap(buffer);
+    if (!spares.empty())
+    {
+        buffer.swap(spares.back());
+        spares.pop_back();
+    }
+    condition.notify_all();
+}
+
+void AsyncWriter::flush ()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!queue.empty() || writing)
+        condition.wait(lock);
+    checkError();
+    if (stream != NULL)
+        stream->flush();
+}
+
+void AsyncWriter::stop ()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        condition.notify_all();
+    }
+    
+    if (thread.joinable())
+        thread.join();
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    checkError();
+}
@@ -0,0 +1,66 @@
+#ifndef _ASYNC_WRITER_H_
+#define _ASYNC_WRITER_H_
+
+#include <RcppEigen.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+// Writes buffers to an output stream on a background thread, so that encoding
+// the next block of data can overlap with I/O for the previous one. The
+// stream must not be touched by anything else until flush() has returned
+class AsyncWriter
+{
+private:
+    std::ostream *stream;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::vector<char> > queue;
+    std::vector<std::vector<char> > spares;
+    bool writing, stopping;
+    std::string error;
+    
+    // Limit on buffers waiting to be written, which bounds memory use
+    static const size_t maxPending = 4;
+    
+    AsyncWriter (const AsyncWriter &) {}
+    AsyncWriter & operator= (const AsyncWriter &) { return *this; }
+    
+    void run ();
+    void checkError ();
+    
+public:
+    AsyncWriter (std::ostream *stream = NULL)
+        : stream(stream), writing(false), stopping(false) {}
+    
+    // Errors can't be reported from here, so call stop() first to see them
+    ~AsyncWriter ()
+    {
+        try
+        {
+            stop();
+        }
+        catch (...) {}
+    }
+    
+    void attach (std::ostream *stream)
+    {
+        flush();
+        this->stream = stream;
+    }
+    
+    // Hand over the contents of the buffer for writing; it is replaced with
+    // an empty one, recycled where possible to avoid reallocation
+    void submit (std::vector<char> &buffer);
+    
+    // Wait until everything submitted so far has reached the stream
+    void flush ();
+    
+    // Finish writing and shut down the thread, throwing if any write failed
+    void stop ();
+};
+
+#endif
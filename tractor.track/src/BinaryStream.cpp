@@ -26,6 +26,23 @@ void BinaryStream::swap (Type *pointer)
     }
 }
 
+// Distinguishes transfers that need no type conversion, which can go directly
+// between the stream and the caller's memory
+template <typename TypeA, typename TypeB> struct SameType { static const bool value = false; };
+template <typename Type> struct SameType<Type,Type> { static const bool value = true; };
+
+template <typename Type>
+void BinaryStream::swapArray (Type *values, const size_t n)
+{
+    switch (sizeof(Type))
+    {
+        case 2: swapBytes16(reinterpret_cast<uint16_t *>(values), n); break;
+        case 4: swapBytes32(reinterpret_cast<uint32_t *>(values), n); break;
+        case 8: swapBytes64(reinterpret_cast<uint64_t *>(values), n); break;
+        default: break;
+    }
+}
+
 template <typename SourceType>
 SourceType BinaryInputStream::readValue ()
 {
@@ -36,6 +53,36 @@ SourceType BinaryInputStream::readValue ()
     return value;
 }
 
+template <typename SourceType, typename FinalType>
+void BinaryInputStream::readArray (FinalType * const values, size_t n)
+{
+    if (n == 0)
+        return;
+    
+    if (SameType<SourceType,FinalType>::value)
+    {
+        // Read straight into the destination and swap there if necessary
+        stream->read((char *) values, n * sizeof(SourceType));
+        if (swapEndian)
+            swapArray(reinterpret_cast<SourceType *>(values), n);
+    }
+    else
+    {
+        // Otherwise stage blocks through the buffer and convert as we go
+        const size_t capacity = bufferCapacity<SourceType>();
+        SourceType *source = reinterpret_cast<SourceType *>(&buffer[0]);
+        for (size_t start=0; start<n; start+=capacity)
+        {
+            const size_t length = std::min(capacity, n-start);
+            stream->read((char *) source, length * sizeof(SourceType));
+            if (swapEndian)
+                swapArray(source, length);
+            for (size_t i=0; i<length; i++)
+                values[start+i] = static_cast<FinalType>(source[i]);
+        }
+    }
+}
+
 template <typename SourceType, typename FinalType>
 void BinaryInputStream::readVector (std::vector<FinalType> &values, size_t n)
 {
@@ -44,42 +91,22 @@ void BinaryInputStream::readVector (std::vector<FinalType> &values, size_t n)
     else
         values.resize(n);
     
-    SourceType value;
-    for (size_t i=0; i<n; i++)
-    {
-        stream->read((char *) &value, sizeof(SourceType));
-        if (swapEndian)
-            swap(&value);
-        values[i] = static_cast<FinalType>(value);
-    }
+    if (n > 0)
+        readArray<SourceType>(&values[0], n);
 }
 
 template <typename SourceType, typename FinalType, int Rows>
 void BinaryInputStream::readVector (Eigen::Matrix<FinalType,Rows,1> &values, size_t n)
 {
     values.resize(n);
-    SourceType value;
-    for (size_t i=0; i<n; i++)
-    {
-        stream->read((char *) &value, sizeof(SourceType));
-        if (swapEndian)
-            swap(&value);
-        values[i] = static_cast<FinalType>(value);
-    }
+    readArray<SourceType>(values.data(), n);
 }
 
 template <typename SourceType, typename FinalType, int Rows>
 void BinaryInputStream::readVector (Eigen::Array<FinalType,Rows,1> &values, size_t n)
 {
     values.resize(n);
-    SourceType value;
-    for (size_t i=0; i<n; i++)
-    {
-        stream->read((char *) &value, sizeof(SourceType));
-        if (swapEndian)
-            swap(&value);
-        values[i] = static_cast<FinalType>(value);
-    }
+    readArray<SourceType>(values.data(), n);
 }
 
 template <typename SourceType, typename FinalType, int Rows, int Cols>
@@ -111,7 +138,8 @@ std::string BinaryInputStream::readString (size_t n)
     {
         char *value = new char[n];
         stream->read(value, n);
-        std::string finalValue(value, std::min(n,strlen(value)));
+        // The string may fill the whole field, with no terminating null
+        std::string finalValue(value, std::find(value, value+n, '\0') - value);
         delete[] value;
         return finalValue;
     }
@@ -134,14 +162,29 @@ void BinaryOutputStream::writeValues (const TargetType value, size_t n)
         stream->write((const char *) &value, sizeof(TargetType));
 }
 
-template <typename TargetType>
-void BinaryOutputStream::writeArray (TargetType * const pointer, size_t n)
+template <typename TargetType, typename OriginalType>
+void BinaryOutputStream::writeArray (const OriginalType * const values, size_t n)
 {
-    for (TargetType *movingPointer=pointer; movingPointer<(pointer+n); movingPointer++)
+    if (n == 0)
+        return;
+    
+    if (SameType<TargetType,OriginalType>::value && !swapEndian)
+    {
+        stream->write((const char *) values, n * sizeof(TargetType));
+        return;
+    }
+    
+    // The caller's data is left untouched; conversion and swapping happen in the buffer
+    const size_t capacity = bufferCapacity<TargetType>();
+    TargetType *target = reinterpret_cast<TargetType *>(&buffer[0]);
+    for (size_t start=0; start<n; start+=capacity)
     {
+        const size_t length = std::min(capacity, n-start);
+        for (size_t i=0; i<length; i++)
+            target[i] = static_cast<TargetType>(values[start+i]);
         if (swapEndian)
-            swap(movingPointer);
-        stream->write((const char *) movingPointer, sizeof(TargetType));
+            swapArray(target, length);
+        stream->write((const char *) target, length * sizeof(TargetType));
     }
 }
 
@@ -151,40 +194,20 @@ void BinaryOutputStream::writeVector (const std::vector<OriginalType> &values, s
     if (n == 0)
         n = values.size();
     
-    TargetType value;
-    for (size_t i=0; i<n; i++)
-    {
-        value = static_cast<TargetType>(values[i]);
-        if (swapEndian)
-            swap(&value);
-        stream->write((const char *) &value, sizeof(TargetType));
-    }
+    if (n > 0)
+        writeArray<TargetType>(&values[0], n);
 }
 
 template <typename TargetType, typename OriginalType, int Rows>
 void BinaryOutputStream::writeVector (const Eigen::Matrix<OriginalType,Rows,1> &values, size_t n)
 {
-    TargetType value;
-    for (size_t i=0; i<n; i++)
-    {
-        value = static_cast<TargetType>(values[i]);
-        if (swapEndian)
-            swap(&value);
-        stream->write((const char *) &value, sizeof(TargetType));
-    }
+    writeArray<TargetType>(values.data(), n);
 }
 
 template <typename TargetType, typename OriginalType, int Rows>
 void BinaryOutputStream::writeVector (const Eigen::Array<OriginalType,Rows,1> &values, size_t n)
 {
-    TargetType value;
-    for (size_t i=0; i<n; i++)
-    {
-        value = static_cast<TargetType>(values[i]);
-        if (swapEndian)
-            swap(&value);
-        stream->write((const char *) &value, sizeof(TargetType));
-    }
+    writeArray<TargetType>(values.data(), n);
 }
 
 template <typename TargetType, typename OriginalType, int Rows, int Cols>
@@ -213,8 +236,13 @@ template float BinaryInputStream::readValue<float> ();
 template int16_t BinaryInputStream::readValue<int16_t> ();
 template int32_t BinaryInputStream::readValue<int32_t> ();
 template uint64_t BinaryInputStream::readValue<uint64_t> ();
+template double BinaryInputStream::readValue<double> ();
+
+template void BinaryInputStream::readArray<float,float> (float * const values, size_t n);
+template void BinaryInputStream::readArray<int32_t,int32_t> (int32_t * const values, size_t n);
 
 template void BinaryInputStream::readVector<float,float> (std::vector<float> &values, size_t n);
+template void BinaryInputStream::readVector<uint64_t,uint64_t> (std::vector<uint64_t> &values, size_t n);
 template void BinaryInputStream::readVector<int16_t,int> (std::vector<int> &values, size_t n);
 
 template void BinaryInputStream::readVector<float> (Eigen::Vector3f &values, size_t n);
@@ -228,15 +256,21 @@ template void BinaryOutputStream::writeValue<float> (float value);
 template void BinaryOutputStream::writeValue<int16_t> (int16_t value);
 template void BinaryOutputStream::writeValue<int32_t> (int32_t value);
 template void BinaryOutputStream::writeValue<uint64_t> (uint64_t value);
+template void BinaryOutputStream::writeValue<double> (double value);
 
 template void BinaryOutputStream::writeValues<char> (char value, size_t n);
 template void BinaryOutputStream::writeValues<float> (float value, size_t n);
 template void BinaryOutputStream::writeValues<int32_t> (int32_t value, size_t n);
+template void BinaryOutputStream::writeValues<double> (double value, size_t n);
 
-template void BinaryOutputStream::writeArray<float> (float * const pointer, size_t n);
+template void BinaryOutputStream::writeArray<float,float> (const float * const values, size_t n);
+template void BinaryOutputStream::writeArray<int32_t,int32_t> (const int32_t * const values, size_t n);
 
 template void BinaryOutputStream::writeVector<float,float>(const std::vector<float> &values, size_t n);
+template void BinaryOutputStream::writeVector<uint64_t,uint64_t>(const std::vector<uint64_t> &values, size_t n);
+template void BinaryOutputStream::writeVector<int32_t,int32_t>(const std::vector<int32_t> &values, size_t n);
 template void BinaryOutputStream::writeVector<int16_t,int>(const std::vector<int> &values, size_t n);
+template void BinaryOutputStream::writeVector<double,double>(const std::vector<double> &values, size_t n);
 
 template void BinaryOutputStream::writeVector<float>(const Eigen::Vector3f &values, size_t n);
 template void BinaryOutputStream::writeVector<float>(const Eigen::Array3f &values, size_t n);
@@ -3,17 +3,59 @@
 
 #include <RcppEigen.h>
 
+// Reverse the byte order of runs of two-, four- and eight-byte values in
+// place; the shifts and masks are simple enough for compilers to vectorise
+inline void swapBytes16 (uint16_t *values, const size_t n)
+{
+    for (size_t i=0; i<n; i++)
+        values[i] = static_cast<uint16_t>((values[i] >> 8) | (values[i] << 8));
+}
+
+inline void swapBytes32 (uint32_t *values, const size_t n)
+{
+    for (size_t i=0; i<n; i++)
+    {
+        const uint32_t x = values[i];
+        values[i] = (x >> 24) | ((x >> 8) & 0x0000ff00u) | ((x << 8) & 0x00ff0000u) | (x << 24);
+    }
+}
+
+inline void swapBytes64 (uint64_t *values, const size_t n)
+{
+    for (size_t i=0; i<n; i++)
+    {
+        uint64_t x = values[i];
+        x = ((x >> 8) & 0x00ff00ff00ff00ffull) | ((x & 0x00ff00ff00ff00ffull) << 8);
+        x = ((x >> 16) & 0x0000ffff0000ffffull) | ((x & 0x0000ffff0000ffffull) << 16);
+        values[i] = (x >> 32) | (x << 32);
+    }
+}
+
 class BinaryStream
 {
 protected:
     bool swapEndian;
     
+    // Staging area for bulk transfers that need conversion or swapping
+    std::vector<char> buffer;
+    static const size_t bufferSize = 1048576;
+    
     template <typename Type> void swap (Type *value);
+    template <typename Type> void swapArray (Type *values, const size_t n);
+    
+    // Number of elements of the given type that fit into the buffer at once
+    template <typename Type> size_t bufferCapacity ()
+    {
+        if (buffer.size() < bufferSize)
+            buffer.resize(bufferSize);
+        return bufferSize / sizeof(Type);
+    }
     
 public:
     BinaryStream ()
         : swapEndian(false) {}
     
+    bool swappingEndianness () const { return swapEndian; }
     void swapEndianness (const bool value) { swapEndian = value; }
 };
 
@@ -32,6 +74,7 @@ public:
     void detach () { this->stream = NULL; }
     
     template <typename SourceType> SourceType readValue ();
+    template <typename SourceType, typename FinalType> void readArray (FinalType * const values, size_t n);
     template <typename SourceType, typename FinalType> void readVector (std::vector<FinalType> &values, size_t n = 0);
     template <typename SourceType, typename FinalType, int Rows> void readVector (Eigen::Matrix<FinalType,Rows,1> &values, size_t n = Rows);
     template <typename SourceType, typename FinalType, int Rows> void readVector (Eigen::Array<FinalType,Rows,1> &values, size_t n = Rows);
@@ -55,7 +98,7 @@ public:
     
     template <typename TargetType> void writeValue (const TargetType value);
     template <typename TargetType> void writeValues (const TargetType value, size_t n);
-    template <typename TargetType> void writeArray (TargetType * const pointer, size_t n);
+    template <typename TargetType, typename OriginalType> void writeArray (const OriginalType * const values, size_t n);
     template <typename TargetType, typename OriginalType> void writeVector (const std::vector<OriginalType> &values, size_t n = 0);
     template <typename TargetType, typename OriginalType, int Rows> void writeVector (const Eigen::Matrix<OriginalType,Rows,1> &values, size_t n = Rows);
     template <typename TargetType, typename OriginalType, int Rows> void writeVector (const Eigen::Array<OriginalType,Rows,1> &values, size_t n = Rows);
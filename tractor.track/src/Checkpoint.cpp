@@ -0,0 +1,91 @@
+#include <RcppEigen.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "BinaryStream.h"
+#include "Checkpoint.h"
+
+using namespace std;
+
+bool Checkpoint::exists () const
+{
+    ifstream stream(fileName.c_str(), ios::binary);
+    return stream.good();
+}
+
+void Checkpoint::save () const
+{
+    // Write to a temporary file first, so that an interruption during saving doesn't leave a corrupt checkpoint
+    const std::string tempFileName = fileName + ".tmp";
+    
+    {
+        ofstream fileStream(tempFileName.c_str(), ios::binary | ios::trunc);
+        BinaryOutputStream binaryStream(&fileStream);
+        
+        fileStream.write("TRKCHKPT", 8);
+        binaryStream.writeValue<int32_t>(1);
+        binaryStream.writeValue<int32_t>(objects.size());
+        for (size_t i=0; i<objects.size(); i++)
+            objects[i]->saveState(binaryStream);
+        
+        fileStream.flush();
+        if (!fileStream.good())
+            throw runtime_error("Failed to write checkpoint file");
+    }
+    
+    // Renaming replaces any previous checkpoint in one step, so there is
+    // always a complete checkpoint on disk. Windows won't rename over an
+    // existing file, so there the old one has to be removed first
+#ifdef _WIN32
+    std::remove(fileName.c_str());
+#endif
+    if (std::rename(tempFileName.c_str(), fileName.c_str()) != 0)
+        throw runtime_error("Failed to replace checkpoint file");
+}
+
+void Checkpoint::restore () const
+{
+    ifstream fileStream(fileName.c_str(), ios::binary);
+    if (!fileStream.good())
+        throw runtime_error("Checkpoint file cannot be opened");
+    
+    BinaryInputStream binaryStream(&fileStream);
+    if (binaryStream.readString(8).compare(0,8,"TRKCHKPT") != 0)
+        throw runtime_error("Checkpoint file does not seem to have a valid magic number");
+    
+    binaryStream.readValue<int32_t>();
+    const int nObjects = binaryStream.readValue<int32_t>();
+    if (nObjects < static_cast<int>(objects.size()))
+        throw runtime_error("Checkpoint file does not match the current pipeline");
+    
+    for (size_t i=0; i<objects.size(); i++)
+        objects[i]->restoreState(binaryStream);
+    
+    if (!fileStream.good())
+        throw runtime_error("Checkpoint file is truncated");
+}
+
+void Checkpoint::remove () const
+{
+    std::remove(fileName.c_str());
+}
+
+void truncateFile (const std::string &fileName, const size_t length)
+{
+#ifdef _WIN32
+    const int fileDescriptor = _open(fileName.c_str(), _O_RDWR | _O_BINARY);
+    const bool failed = (fileDescriptor < 0 || _chsize(fileDescriptor, static_cast<long>(length)) != 0);
+    if (fileDescriptor >= 0)
+        _close(fileDescriptor);
+#else
+    const bool failed = (truncate(fileName.c_str(), static_cast<off_t>(length)) != 0);
+#endif
+    
+    if (failed)
+        throw runtime_error("Failed to truncate file " + fileName);
+}
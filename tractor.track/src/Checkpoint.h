@@ -0,0 +1,47 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <RcppEigen.h>
+
+#include "BinaryStream.h"
+
+// Interface for objects whose state can be saved and later restored, so that
+// a long-running pipeline can be resumed after interruption
+class Checkpointable
+{
+public:
+    virtual ~Checkpointable () {}
+    
+    virtual void saveState (BinaryOutputStream &stream) = 0;
+    virtual void restoreState (BinaryInputStream &stream) = 0;
+};
+
+// A checkpoint file: the states of a series of objects, always stored and
+// recovered in the order in which the objects were added. Restoring may stop
+// early, so a prefix of the objects can be recovered on its own
+class Checkpoint
+{
+private:
+    std::string fileName;
+    std::vector<Checkpointable*> objects;
+    
+public:
+    Checkpoint (const std::string &fileName)
+        : fileName(fileName) {}
+    
+    void add (Checkpointable * const object)
+    {
+        if (object != NULL)
+            objects.push_back(object);
+    }
+    
+    bool exists () const;
+    void save () const;
+    void restore () const;
+    void remove () const;
+};
+
+// Truncate a file to a given length, discarding anything written after a checkpoint
+void truncateFile (const std::string &fileName, const size_t length);
+
+#endif
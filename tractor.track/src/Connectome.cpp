@@ -0,0 +1,158 @@
+#include <RcppEigen.h>
+
+#include "Connectome.h"
+
+ConnectomeDataSink::ConnectomeDataSink (const Array<int> &parcellation, const EdgeDefinition definition)
+    : parcellation(parcellation), definition(definition)
+{
+    if (parcellation.getDimensions().size() != 3)
+        throw std::invalid_argument("Parcellation image must be three-dimensional");
+    
+    std::set<int> labels;
+    for (Array<int>::const_iterator it=parcellation.begin(); it!=parcellation.end(); it++)
+    {
+        if (*it > 0)
+            labels.insert(*it);
+    }
+    regions.assign(labels.begin(), labels.end());
+}
+
+void ConnectomeDataSink::setScalars (const Array<float> &scalars)
+{
+    if (scalars.getDimensions() != parcellation.getDimensions())
+        throw std::invalid_argument("Scalar image dimensions don't match the parcellation");
+    this->scalars = scalars;
+}
+
+void ConnectomeDataSink::addEdge (int from, int to, const double length, const double scalar)
+{
+    if (from > to)
+        std::swap(from, to);
+    Edge &edge = edges[std::make_pair(from,to)];
+    edge.count++;
+    edge.lengthSum += length;
+    edge.scalarSum += scalar;
+}
+
+void ConnectomeDataSink::put (const Streamline &data)
+{
+    const std::vector<Space<3>::Point> &leftPoints = data.getLeftPoints();
+    const std::vector<Space<3>::Point> &rightPoints = data.getRightPoints();
+    const std::vector<int> &dims = parcellation.getDimensions();
+    const bool usingScalars = !scalars.empty();
+    
+    // Label the points in order, from the left end to the right; the seed is
+    // the first point on both sides, so it is only included once
+    pointLabels.clear();
+    double scalarSum = 0.0;
+    size_t nScalars = 0;
+    const size_t nLeft = leftPoints.size(), nRight = rightPoints.size();
+    for (size_t i=0; i<nLeft+nRight; i++)
+    {
+        if (i == nLeft && nLeft > 0)
+            continue;
+        const Space<3>::Point &point = (i < nLeft ? leftPoints[nLeft-i-1] : rightPoints[i-nLeft]);
+        
+        int loc[3];
+        bool inside = true;
+        for (int j=0; j<3; j++)
+        {
+            loc[j] = static_cast<int>(round(point[j]));
+            if (loc[j] < 0 || loc[j] >= dims[j])
+                inside = false;
+        }
+        
+        if (!inside)
+        {
+            pointLabels.push_back(0);
+            continue;
+        }
+        
+        const size_t index = loc[0] + dims[0] * (loc[1] + static_cast<size_t>(dims[1]) * loc[2]);
+        pointLabels.push_back(std::max(parcellation[index], 0));
+        if (usingScalars)
+        {
+            scalarSum += scalars[index];
+            nScalars++;
+        }
+    }
+    
+    const double length = data.getLeftLength() + data.getRightLength();
+    const double scalar = (nScalars > 0 ? scalarSum / nScalars : 0.0);
+    
+    if (definition == EndpointEdges)
+    {
+        // The outermost labelled point on each side gives the end regions
+        int first = 0, last = 0;
+        for (size_t i=0; i<pointLabels.size() && first == 0; i++)
+            first = pointLabels[i];
+        for (size_t i=pointLabels.size(); i>0 && last == 0; i--)
+            last = pointLabels[i-1];
+        if (first > 0 && first != last)
+            addEdge(first, last, length, scalar);
+    }
+    else
+    {
+        std::sort(pointLabels.begin(), pointLabels.end());
+        pointLabels.erase(std::unique(pointLabels.begin(), pointLabels.end()), pointLabels.end());
+        if (!pointLabels.empty() && pointLabels[0] == 0)
+            pointLabels.erase(pointLabels.begin());
+        
+        for (size_t i=0; i<pointLabels.size(); i++)
+        {
+            for (size_t j=i+1; j<pointLabels.size(); j++)
+                addEdge(pointLabels[i], pointLabels[j], length, scalar);
+        }
+    }
+}
+
+void ConnectomeDataSink::saveState (BinaryOutputStream &stream)
+{
+    stream.writeValue<uint64_t>(edges.size());
+    for (std::map<std::pair<int,int>,Edge>::const_iterator it=edges.begin(); it!=edges.end(); it++)
+    {
+        stream.writeValue<int32_t>(it->first.first);
+        stream.writeValue<int32_t>(it->first.second);
+        stream.writeValue<uint64_t>(it->second.count);
+        stream.writeValue<double>(it->second.lengthSum);
+        stream.writeValue<double>(it->second.scalarSum);
+    }
+}
+
+void ConnectomeDataSink::restoreState (BinaryInputStream &stream)
+{
+    edges.clear();
+    const size_t n = stream.readValue<uint64_t>();
+    for (size_t i=0; i<n; i++)
+    {
+        const int from = stream.readValue<int32_t>();
+        const int to = stream.readValue<int32_t>();
+        Edge &edge = edges[std::make_pair(from,to)];
+        edge.count = stream.readValue<uint64_t>();
+        edge.lengthSum = stream.readValue<double>();
+        edge.scalarSum = stream.readValue<double>();
+    }
+}
+
+void ConnectomeDataSink::writeEdgeList (const std::string &fileName) const
+{
+    std::ofstream fileStream(fileName.c_str());
+    if (!fileStream)
+        throw std::runtime_error("Can't open connectome file " + fileName + " for writing");
+    
+    fileStream << "# regions";
+    for (size_t i=0; i<regions.size(); i++)
+        fileStream << " " << regions[i];
+    fileStream << "\nfrom\tto\tcount\tlength" << (scalars.empty() ? "" : "\tscalar") << "\n";
+    
+    // Lengths and scalar values are means over the streamlines making up each edge
+    fileStream.precision(10);
+    for (std::map<std::pair<int,int>,Edge>::const_iterator it=edges.begin(); it!=edges.end(); it++)
+    {
+        const Edge &edge = it->second;
+        fileStream << it->first.first << "\t" << it->first.second << "\t" << edge.count << "\t" << edge.lengthSum / edge.count;
+        if (!scalars.empty())
+            fileStream << "\t" << edge.scalarSum / edge.count;
+        fileStream << "\n";
+    }
+}
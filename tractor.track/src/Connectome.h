@@ -0,0 +1,67 @@
+#ifndef _CONNECTOME_H_
+#define _CONNECTOME_H_
+
+#include "DataSource.h"
+#include "Streamline.h"
+#include "Array.h"
+#include "Checkpoint.h"
+
+// Connectome: counts the streamlines connecting each pair of regions in a
+// parcellation, along with their mean length and (optionally) the mean of a
+// scalar image, such as FA, along them. Regions are positive labels, and
+// points are assigned to the region containing them. With endpoint edges, a
+// streamline connects the outermost regions it passes through on each side,
+// if they differ; with traversal edges, it connects every pair of regions
+// it passes through
+class ConnectomeDataSink : public DataSink<Streamline>, public Checkpointable
+{
+public:
+    enum EdgeDefinition { EndpointEdges, TraversalEdges };
+    
+private:
+    struct Edge
+    {
+        size_t count;
+        double lengthSum, scalarSum;
+        
+        Edge ()
+            : count(0), lengthSum(0.0), scalarSum(0.0) {}
+    };
+    
+    Array<int> parcellation;
+    Array<float> scalars;
+    EdgeDefinition definition;
+    
+    // The regions present in the parcellation, in order
+    std::vector<int> regions;
+    
+    // Edges are stored with the smaller label first
+    std::map<std::pair<int,int>,Edge> edges;
+    
+    // Labels of each point along the current streamline, reused between streamlines
+    std::vector<int> pointLabels;
+    
+    void addEdge (int from, int to, const double length, const double scalar);
+    
+    // Hide default constructor
+    ConnectomeDataSink () {}
+    
+public:
+    ConnectomeDataSink (const Array<int> &parcellation, const EdgeDefinition definition = EndpointEdges);
+    
+    // Use a scalar image, which must match the parcellation, to weight edges
+    void setScalars (const Array<float> &scalars);
+    
+    void put (const Streamline &data);
+    
+    void saveState (BinaryOutputStream &stream);
+    void restoreState (BinaryInputStream &stream);
+    
+    size_t nEdges () const { return edges.size(); }
+    
+    // Write the edges as a text table, with one row per pair of connected
+    // regions; the first line is a comment listing all the regions
+    void writeEdgeList (const std::string &fileName) const;
+};
+
+#endif
@@ -5,9 +5,40 @@
 template <class ElementType> class DataSource
 {
 public:
+    virtual ~DataSource () {}
+    
     virtual bool more () { return false; }
     virtual void get (ElementType &data) {}
     virtual void seek (const int n) {}
+    
+    // Append up to n elements to a block, returning the number added; sources
+    // that can produce several elements at once (e.g. in parallel) may override this
+    virtual size_t getBlock (std::list<ElementType> &block, const size_t n)
+    {
+        size_t i;
+        for (i=0; i<n && more(); i++)
+        {
+            ElementType element;
+            get(element);
+            block.push_back(element);
+        }
+        return i;
+    }
+    
+    // Append the elements at the given (sorted) indices to a block; seekable
+    // sources that can read several elements at once may override this
+    virtual size_t getElements (std::list<ElementType> &block, const std::vector<size_t> &indices)
+    {
+        for (size_t i=0; i<indices.size(); i++)
+        {
+            seek(indices[i]);
+            ElementType element;
+            get(element);
+            block.push_back(element);
+        }
+        return indices.size();
+    }
+    
     virtual bool seekable () { return false; }
 };
 
@@ -35,6 +66,9 @@ public:
     
     // If the return value is false, the element will be removed
     virtual bool process (ElementType &data) { return true; }
+    
+    // True if process() may be called for different elements concurrently
+    virtual bool threadSafe () const { return false; }
 };
 
 #endif
@@ -4,7 +4,7 @@
 #include "Grid.h"
 #include "DiffusionModel.h"
 
-std::vector<int> DiffusionModel::probabilisticRound (const Space<3>::Point &point, const int size) const
+std::vector<int> DiffusionModel::probabilisticRound (const Space<3>::Point &point, RandomGenerator &random, const int size) const
 {
     std::vector<int> result(size, 0);
     const Eigen::Array3i imageDims = grid.dimensions();
@@ -17,7 +17,7 @@ std::vector<int> DiffusionModel::probabilisticRound (const Space<3>::Point &poin
         
         float distance = point[i] - pointFloor;
         
-        float uniformSample = static_cast<float>(R::unif_rand());
+        float uniformSample = static_cast<float>(random.uniform());
         if ((uniformSample > distance && pointFloor >= 0.0) || pointCeiling >= static_cast<float>(imageDims(i,0)))
             result[i] = static_cast<int>(pointFloor);
         else
@@ -40,9 +40,9 @@ DiffusionTensorModel::DiffusionTensorModel (const std::string &pdFile)
     principalDirections = getImageArray<float>(image);
 }
 
-Space<3>::Vector DiffusionTensorModel::sampleDirection (const Space<3>::Point &point, const Space<3>::Vector &referenceDirection) const
+Space<3>::Vector DiffusionTensorModel::sampleDirection (const Space<3>::Point &point, const Space<3>::Vector &referenceDirection, RandomGenerator &random) const
 {
-    std::vector<int> roundedPoint = probabilisticRound(point, 4);
+    std::vector<int> roundedPoint = probabilisticRound(point, random, 4);
     Space<3>::Vector stepVector;
     
     for (int i=0; i<3; i++)
@@ -82,12 +82,12 @@ BedpostModel::BedpostModel (const std::vector<std::string> &avfFiles, const std:
     nSamples = avfDims[3];
 }
 
-Space<3>::Vector BedpostModel::sampleDirection (const Space<3>::Point &point, const Space<3>::Vector &referenceDirection) const
+Space<3>::Vector BedpostModel::sampleDirection (const Space<3>::Point &point, const Space<3>::Vector &referenceDirection, RandomGenerator &random) const
 {
-    std::vector<int> roundedPoint = probabilisticRound(point, 4);
+    std::vector<int> roundedPoint = probabilisticRound(point, random, 4);
     
     // Randomly choose a sample number
-    roundedPoint[3] = static_cast<int>(round(R::unif_rand() * (nSamples-1)));
+    roundedPoint[3] = static_cast<int>(round(random.uniform() * (nSamples-1)));
     
     // NB: Currently assuming always at least one anisotropic compartment
     int closestIndex = 0;
@@ -4,18 +4,20 @@
 #include "Space.h"
 #include "Grid.h"
 #include "Array.h"
+#include "Random.h"
 
 class DiffusionModel : public Griddable3D
 {
 protected:
     Grid<3> grid;
     
-    std::vector<int> probabilisticRound (const Space<3>::Point &point, const int size = 3) const;
+    std::vector<int> probabilisticRound (const Space<3>::Point &point, RandomGenerator &random, const int size = 3) const;
     
 public:
     virtual ~DiffusionModel () {}
     
-    virtual Space<3>::Vector sampleDirection (const Space<3>::Point &point, const Space<3>::Vector &referenceDirection) const
+    // Implementations must be safe to call concurrently, drawing random numbers only from the generator given
+    virtual Space<3>::Vector sampleDirection (const Space<3>::Point &point, const Space<3>::Vector &referenceDirection, RandomGenerator &random) const
     {
         return Space<3>::zeroVector();
     }
@@ -39,7 +41,7 @@ public:
         delete principalDirections;
     }
     
-    Space<3>::Vector sampleDirection (const Space<3>::Point &point, const Space<3>::Vector &referenceDirection) const;
+    Space<3>::Vector sampleDirection (const Space<3>::Point &point, const Space<3>::Vector &referenceDirection, RandomGenerator &random) const;
 };
 
 class BedpostModel : public DiffusionModel
@@ -72,7 +74,7 @@ public:
     
     void setAvfThreshold (const float avfThreshold) { this->avfThreshold = avfThreshold; }
     
-    Space<3>::Vector sampleDirection (const Space<3>::Point &point, const Space<3>::Vector &referenceDirection) const;
+    Space<3>::Vector sampleDirection (const Space<3>::Point &point, const Space<3>::Vector &referenceDirection, RandomGenerator &random) const;
 };
 
 #endif
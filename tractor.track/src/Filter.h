@@ -22,6 +22,8 @@ public:
             return false;
         return true;
     }
+    
+    bool threadSafe () const { return true; }
 };
 
 class LabelCountFilter : public DataManipulator<Streamline>
@@ -42,6 +44,8 @@ public:
             return false;
         return true;
     }
+    
+    bool threadSafe () const { return true; }
 };
 
 #endif
@@ -0,0 +1,69 @@
+#include <RcppEigen.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "MemoryMappedFile.h"
+
+void MemoryMappedFile::open (const std::string &fileName)
+{
+    close();
+    
+#ifdef _WIN32
+    std::ifstream fileStream(fileName.c_str(), std::ios::binary);
+    if (!fileStream.good())
+        throw std::runtime_error("Failed to open file " + fileName);
+    buffer.assign(std::istreambuf_iterator<char>(fileStream), std::istreambuf_iterator<char>());
+    length = buffer.size();
+    data = (length > 0 ? &buffer[0] : "");
+#else
+    const int fileDescriptor = ::open(fileName.c_str(), O_RDONLY);
+    if (fileDescriptor < 0)
+        throw std::runtime_error("Failed to open file " + fileName);
+    
+    struct stat info;
+    if (fstat(fileDescriptor, &info) != 0)
+    {
+        ::close(fileDescriptor);
+        throw std::runtime_error("Failed to find the size of file " + fileName);
+    }
+    length = static_cast<size_t>(info.st_size);
+    
+    // An empty file can't be mapped, but there's nothing to read anyway
+    if (length == 0)
+        data = "";
+    else
+    {
+        void *address = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        if (address == MAP_FAILED)
+        {
+            ::close(fileDescriptor);
+            length = 0;
+            throw std::runtime_error("Failed to map file " + fileName + " into memory");
+        }
+        
+        // Streamline files are almost always read from start to finish
+        madvise(address, length, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(address);
+    }
+    
+    // The mapping remains valid after the descriptor is closed
+    ::close(fileDescriptor);
+#endif
+}
+
+void MemoryMappedFile::close ()
+{
+#ifndef _WIN32
+    if (data != NULL && length > 0)
+        munmap(const_cast<char *>(data), length);
+#endif
+    
+    buffer.clear();
+    data = NULL;
+    length = 0;
+}
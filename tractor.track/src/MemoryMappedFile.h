@@ -0,0 +1,43 @@
+#ifndef _MEMORY_MAPPED_FILE_H_
+#define _MEMORY_MAPPED_FILE_H_
+
+#include <RcppEigen.h>
+
+// A read-only view of a whole file's contents. Where possible the file is
+// memory-mapped, so pages are read on demand and nothing is copied; on
+// Windows the contents are read into memory instead
+class MemoryMappedFile
+{
+private:
+    const char *data;
+    size_t length;
+    std::vector<char> buffer;
+    
+    // Copying would unmap the file twice
+    MemoryMappedFile (const MemoryMappedFile &) {}
+    MemoryMappedFile & operator= (const MemoryMappedFile &) { return *this; }
+    
+public:
+    MemoryMappedFile ()
+        : data(NULL), length(0) {}
+    
+    MemoryMappedFile (const std::string &fileName)
+        : data(NULL), length(0)
+    {
+        open(fileName);
+    }
+    
+    ~MemoryMappedFile ()
+    {
+        close();
+    }
+    
+    void open (const std::string &fileName);
+    void close ();
+    
+    bool isOpen () const { return (data != NULL); }
+    const char * begin () const { return data; }
+    size_t size () const { return length; }
+};
+
+#endif
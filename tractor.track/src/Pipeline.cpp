@@ -3,18 +3,113 @@
 #include "Streamline.h"
 #include "Pipeline.h"
 
+template <class ElementType>
+void Pipeline<ElementType>::manipulate ()
+{
+    bool parallel = (nThreads > 1 && workingSet.size() > 1);
+    for (size_t i=0; i<manipulators.size() && parallel; i++)
+        parallel = manipulators[i]->threadSafe();
+    
+    if (!parallel)
+    {
+        // Apply the manipulators in sequence, removing elements as we go
+        for (size_t i=0; i<manipulators.size(); i++)
+        {
+            typename std::list<ElementType>::iterator it = workingSet.begin();
+            while (it != workingSet.end())
+            {
+                bool keep = manipulators[i]->process(*it);
+                if (keep)
+                    it++;
+                else
+                {
+                    it = workingSet.erase(it);
+                    total--;
+                }
+            }
+        }
+        return;
+    }
+    
+    // Otherwise each element goes through the whole sequence on a worker
+    // thread, and rejected elements are removed afterwards, preserving order
+    std::vector<ElementType*> elements;
+    for (typename std::list<ElementType>::iterator it=workingSet.begin(); it!=workingSet.end(); it++)
+        elements.push_back(&(*it));
+    std::vector<char> keep(elements.size(), 1);
+    std::string errorMessage;
+    
+    #pragma omp parallel for num_threads(nThreads) schedule(dynamic,16)
+    for (long j=0; j<static_cast<long>(elements.size()); j++)
+    {
+        // Exceptions can't propagate out of the parallel region
+        try
+        {
+            for (size_t i=0; i<manipulators.size() && keep[j]; i++)
+                keep[j] = manipulators[i]->process(*elements[j]);
+        }
+        catch (std::exception &e)
+        {
+            #pragma omp critical
+            errorMessage = e.what();
+        }
+    }
+    
+    if (!errorMessage.empty())
+        throw std::runtime_error(errorMessage);
+    
+    size_t j = 0;
+    typename std::list<ElementType>::iterator it = workingSet.begin();
+    while (it != workingSet.end())
+    {
+        if (keep[j++])
+            it++;
+        else
+        {
+            it = workingSet.erase(it);
+            total--;
+        }
+    }
+}
+
 template <class ElementType>
 size_t Pipeline<ElementType>::run ()
 {
-    size_t total = 0, subsetIndex = 0;
+    size_t subsetIndex = 0, sinceCheckpoint = 0, nCheckpoints = 0;
     const bool usingSubset = (subset.size() > 0);
     bool subsetFinished = false;
     std::vector<size_t> keepList;
     
     // If there's no data source there's nothing to do
+    total = 0;
     if (source == NULL)
         return 0;
     
+    // Register the source and sinks with the checkpoint, and restore their state if requested
+    if (checkpoint != NULL)
+    {
+        if (usingSubset)
+            throw std::runtime_error("Checkpointing is not supported when processing a subset");
+        
+        checkpoint->add(this);
+        
+        Checkpointable *object = dynamic_cast<Checkpointable*>(source);
+        if (object == NULL)
+            throw std::runtime_error("Pipeline data source does not support checkpointing");
+        checkpoint->add(object);
+        
+        for (size_t i=0; i<sinks.size(); i++)
+        {
+            object = dynamic_cast<Checkpointable*>(sinks[i]);
+            if (object == NULL)
+                throw std::runtime_error("Pipeline data sink does not support checkpointing");
+            checkpoint->add(object);
+        }
+        
+        if (resume)
+            checkpoint->restore();
+    }
+    
     // Empty the working set
     workingSet.clear();
     
@@ -22,55 +117,37 @@ size_t Pipeline<ElementType>::run ()
     {
         Rcpp::checkUserInterrupt();
         
-        // Skip forward to the next element in the subset if necessary
+        // Get the next element(s) and insert into the working set
         // FIXME: What if we're using a subset and the source isn't seekable?
         if (usingSubset && source->seekable())
         {
-            if (subsetIndex >= subset.size())
-                subsetFinished = true;
-            else
-                source->seek(subset[subsetIndex]);
-            
-            subsetIndex++;
+            // Request the rest of the block's worth of subset elements together
+            const size_t count = std::min(blockSize - workingSet.size(), subset.size() - subsetIndex);
+            const std::vector<size_t> indices(subset.begin() + subsetIndex, subset.begin() + subsetIndex + count);
+            source->getElements(workingSet, indices);
+            subsetIndex += count;
+            subsetFinished = (subsetIndex >= subset.size());
         }
-        
-        // Get the next element and insert it into the working set
-        // If the subset is finished we don't want any more elements, so skip this
-        if (!subsetFinished)
+        else if (usingSubset)
         {
             ElementType element;
             source->get(element);
             workingSet.push_back(element);
         }
+        else
+            source->getBlock(workingSet, blockSize - workingSet.size());
         
         // Process the data when the working set is full or there's nothing more incoming
         if (workingSet.size() == blockSize || !source->more() || subsetFinished)
         {
             total += workingSet.size();
+            sinceCheckpoint += workingSet.size();
             
             // Apply the manipulator(s), if there are any
-            for (int i=0; i<manipulators.size(); i++)
-            {
-                typename std::list<ElementType>::iterator it = workingSet.begin();
-                while (it != workingSet.end())
-                {
-                    bool keep = manipulators[i]->process(*it);
-                    if (keep)
-                        it++;
-                    else
-                    {
-                        it = workingSet.erase(it);
-                        total--;
-                    }
-                }
-            }
-            
-            // If the manipulators have thrown out everything, there's nothing left to do
-            if (workingSet.empty())
-                continue;
+            manipulate();
             
-            // Pass the remaining data to the sink(s)
-            for (int i=0; i<sinks.size(); i++)
+            // Pass the remaining data to the sink(s), unless the manipulators have thrown out everything
+            for (size_t i=0; i<sinks.size() && !workingSet.empty(); i++)
             {
                 // Tell the sink how many elements are incoming and provide an iterator
                 sinks[i]->setup(workingSet.size(), workingSet.begin(), workingSet.end());
@@ -84,6 +161,15 @@ size_t Pipeline<ElementType>::run ()
             
             // Empty the working set again
             workingSet.clear();
+            
+            // Checkpoint if enough data has gone through, and there's more to come
+            if (checkpoint != NULL && checkpointInterval > 0 && sinceCheckpoint >= checkpointInterval && source->more())
+            {
+                checkpoint->save();
+                sinceCheckpoint = 0;
+                if (checkpointLimit > 0 && ++nCheckpoints >= checkpointLimit)
+                    throw Rcpp::internal::InterruptedException();
+            }
         }
     }
     
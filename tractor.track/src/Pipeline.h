@@ -2,11 +2,13 @@
 #define _PIPELINE_H_
 
 #include "DataSource.h"
+#include "Checkpoint.h"
 
 // Pipeline: a general blockwise processing structure
 // If there are multiple manipulators then they are applied in sequence
 // If there are multiple sinks then data are sent to all of them
-template <class ElementType> class Pipeline
+// With a checkpoint, the state of the source and sinks is saved between blocks
+template <class ElementType> class Pipeline : public Checkpointable
 {
 private:
     DataSource<ElementType> *source;
@@ -16,10 +18,19 @@ private:
     size_t blockSize;
     std::vector<size_t> subset;
     std::list<ElementType> workingSet;
+    size_t total;
+    
+    Checkpoint *checkpoint;
+    size_t checkpointInterval, checkpointLimit;
+    bool resume;
+    
+    int nThreads;
+    
+    void manipulate ();
     
 public:
     Pipeline (DataSource<ElementType> * const source = NULL, const size_t blockSize = 1000)
-        : source(source), blockSize(blockSize) {}
+        : source(source), blockSize(blockSize), total(0), checkpoint(NULL), checkpointInterval(0), checkpointLimit(0), resume(false), nThreads(1) {}
     
     ~Pipeline ()
     {
@@ -33,6 +44,9 @@ public:
     void setBlockSize (const size_t blockSize) { this->blockSize = blockSize; }
     void setSource (DataSource<ElementType> * const source) { this->source = source; }
     
+    // Manipulators are applied to each block in parallel if they are all thread-safe
+    void setThreads (const int nThreads) { this->nThreads = std::max(nThreads, 1); }
+    
     template <typename VectorElementType>
     void setSubset (const std::vector<VectorElementType> &elements)
     {
@@ -57,6 +71,23 @@ public:
             sinks.push_back(sink);
     }
     
+    // Save a checkpoint after each block once at least "interval" elements
+    // have been read since the last one; if "resume" is true, the state is
+    // first restored from the checkpoint. Objects are added to the checkpoint
+    // (after any already there) when run() is called. A positive "limit"
+    // stops the run, as though the user had interrupted it, once that many
+    // checkpoints have been saved, so that resumption can be tested
+    void setCheckpoint (Checkpoint * const checkpoint, const size_t interval, const bool resume = false, const size_t limit = 0)
+    {
+        this->checkpoint = checkpoint;
+        this->checkpointInterval = interval;
+        this->checkpointLimit = limit;
+        this->resume = resume;
+    }
+    
+    void saveState (BinaryOutputStream &stream) { stream.writeValue<uint64_t>(total); }
+    void restoreState (BinaryInputStream &stream) { total = stream.readValue<uint64_t>(); }
+    
     size_t run ();
 };
 
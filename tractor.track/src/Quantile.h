@@ -0,0 +1,51 @@
+#ifndef _QUANTILE_H_
+#define _QUANTILE_H_
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+// Streaming quantile sketch for values in a known range, which is divided
+// into equal bins. Storage is fixed by the number of bins, however many
+// values are added, and quantiles are correct to within half a bin width
+// regardless of the order of the values. Values outside the range are
+// counted in the first or last bin
+class QuantileHistogram
+{
+private:
+    double lower, width;
+    std::vector<uint32_t> counts;
+    size_t total;
+    
+public:
+    QuantileHistogram ()
+        : lower(0.0), width(1.0), total(0) {}
+    
+    QuantileHistogram (const double lower, const double upper, const int nBins)
+        : lower(lower), width((upper - lower) / nBins), counts(nBins, 0), total(0) {}
+    
+    size_t size () const { return total; }
+    
+    void add (const double value)
+    {
+        const double bin = floor((value - lower) / width);
+        const int index = static_cast<int>(std::min(std::max(bin, 0.0), static_cast<double>(counts.size() - 1)));
+        counts[index]++;
+        total++;
+    }
+    
+    // The value of the element at the specified (zero-based) position in sorted order
+    double nthElement (const size_t n) const
+    {
+        size_t cumulative = 0;
+        for (size_t i=0; i<counts.size(); i++)
+        {
+            cumulative += counts[i];
+            if (cumulative > n)
+                return lower + (i + 0.5) * width;
+        }
+        return NAN;
+    }
+};
+
+#endif
@@ -2,6 +2,10 @@
 
 #include "RCallback.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 void RCallbackDataSink::put (const Streamline &data)
 {
     Eigen::ArrayX3f points;
@@ -24,31 +28,291 @@ void RCallbackDataSink::put (const Streamline &data)
     function(pointsR, seedIndexR, data.getVoxelDimensions(), unit);
 }
 
-void ProfileMatrixDataSink::put (const Streamline &data)
+// The number of rows a streamline takes up when its two sides are joined
+static size_t concatenatedSize (const Streamline &data)
+{
+    const size_t nLeft = data.getLeftPoints().size(), nRight = data.getRightPoints().size();
+    if (nLeft == 0 && nRight == 0)
+        return 0;
+    else
+        return (nLeft > 1 ? nLeft - 1 : 0) + (nRight > 0 ? nRight : 1);
+}
+
+void BatchedRCallbackDataSink::setup (const size_type &count, const_iterator begin, const_iterator end)
+{
+    if (count == 0)
+        return;
+    
+    // Find the total numbers of points and labels first, so that the R
+    // objects can be allocated once for the whole block
+    size_t nPoints = 0, nLabels = 0;
+    const int nScalars = begin->nScalars(), nProperties = begin->nProperties();
+    for (const_iterator it=begin; it!=end; it++)
+    {
+        nPoints += concatenatedSize(*it);
+        nLabels += it->nLabels();
+        if (it->nScalars() != nScalars || it->nProperties() != nProperties)
+            throw std::runtime_error("Streamlines in a batch must all have the same scalars and properties");
+    }
+    
+    Rcpp::NumericMatrix pointsR(nPoints, 3), scalarsR(nPoints, nScalars), propertiesR(count, nProperties);
+    Rcpp::IntegerVector offsetsR(count + 1), seedsR(count), labelOffsetsR(count + 1), labelsR(nLabels);
+    
+    // Points and offsets follow the conventions of the unbatched callback;
+    // the points of streamline i (counting from zero) are in rows
+    // offsets[i]+1 to offsets[i+1] of the matrix
+    const Streamline::PointType pointType = begin->getPointType();
+    const double shift = (pointType == Streamline::VoxelPointType ? 1.0 : 0.0);
+    size_t row = 0, labelIndex = 0, i = 0;
+    for (const_iterator it=begin; it!=end; it++, i++)
+    {
+        const std::vector<Space<3>::Point> &leftPoints = it->getLeftPoints();
+        const std::vector<Space<3>::Point> &rightPoints = it->getRightPoints();
+        
+        offsetsR[i] = static_cast<int>(row);
+        labelOffsetsR[i] = static_cast<int>(labelIndex);
+        
+        if (nScalars > 0)
+        {
+            Eigen::ArrayXXf scalars;
+            it->concatenateScalars(scalars);
+            for (int j=0; j<scalars.rows(); j++)
+            {
+                for (int k=0; k<nScalars; k++)
+                    scalarsR(row+j,k) = scalars(j,k);
+            }
+        }
+        for (int k=0; k<nProperties; k++)
+            propertiesR(i,k) = it->getProperties()[k];
+        
+        if (leftPoints.size() == 0 && rightPoints.size() == 0)
+            seedsR[i] = NA_INTEGER;
+        else
+        {
+            seedsR[i] = static_cast<int>(leftPoints.size() > 0 ? leftPoints.size() - 1 : 0) + 1;
+            
+            // The left points run outwards from the seed, which is also the
+            // first right point, so they are reversed and the seed dropped
+            for (size_t j=leftPoints.size(); j>1; j--, row++)
+            {
+                for (int k=0; k<3; k++)
+                    pointsR(row,k) = leftPoints[j-1][k] + shift;
+            }
+            if (rightPoints.size() > 0)
+            {
+                for (size_t j=0; j<rightPoints.size(); j++, row++)
+                {
+                    for (int k=0; k<3; k++)
+                        pointsR(row,k) = rightPoints[j][k] + shift;
+                }
+            }
+            else
+            {
+                for (int k=0; k<3; k++)
+                    pointsR(row,k) = leftPoints[0][k] + shift;
+                row++;
+            }
+        }
+        
+        const std::set<int> &labels = it->getLabels();
+        for (std::set<int>::const_iterator lit=labels.begin(); lit!=labels.end(); lit++, labelIndex++)
+            labelsR[labelIndex] = *lit;
+    }
+    offsetsR[count] = static_cast<int>(row);
+    labelOffsetsR[count] = static_cast<int>(labelIndex);
+    
+    const std::string unit = (pointType == Streamline::VoxelPointType ? "vox" : "mm");
+    
+    Rcpp::List batch = Rcpp::List::create(Rcpp::Named("points")=pointsR, Rcpp::Named("offsets")=offsetsR, Rcpp::Named("seeds")=seedsR, Rcpp::Named("voxelDims")=begin->getVoxelDimensions(), Rcpp::Named("coordUnit")=unit, Rcpp::Named("labelOffsets")=labelOffsetsR, Rcpp::Named("labels")=labelsR, Rcpp::Named("scalars")=scalarsR, Rcpp::Named("properties")=propertiesR);
+    function(batch);
+}
+
+size_t ProfileMatrixDataSink::rowIndex (const Streamline &data) const
+{
+    if (nSeeds == 0)
+        return 0;
+    
+    const int seed = data.getSeedNumber();
+    if (seed < 0 || static_cast<size_t>(seed) >= nSeeds)
+        throw std::runtime_error("Streamline seed number is out of range for the profile matrix");
+    return static_cast<size_t>(seed);
+}
+
+void ProfileMatrixDataSink::add (const Streamline &data, std::vector<size_t> &counts) const
 {
     const std::set<int> &labels = data.getLabels();
+    if (labels.empty())
+        return;
+    
+    const size_t rowStart = rowIndex(data) * nLabels;
     for (std::set<int>::const_iterator it=labels.begin(); it!=labels.end(); it++)
     {
-        if (counts.count(*it) == 0)
-            counts[*it] = 1;
-        else
-            counts[*it]++;
+        if (*it < minLabel || *it >= minLabel + nLabels)
+            throw std::runtime_error("Streamline label is outside the target label range");
+        counts[rowStart + (*it - minLabel)]++;
     }
 }
 
-void ProfileMatrixDataSink::done ()
+void ProfileMatrixDataSink::reduce ()
+{
+    for (size_t j=0; j<shards.size(); j++)
+    {
+        if (shards[j].empty())
+            continue;
+        
+        for (size_t i=0; i<counts.size(); i++)
+            counts[i] += shards[j][i];
+        std::vector<size_t>().swap(shards[j]);
+    }
+}
+
+void ProfileMatrixDataSink::setup (const size_type &count, const_iterator begin, const_iterator end)
 {
-    std::vector<int> labels;
-    std::vector<size_t> labelCounts;
+    // Small blocks aren't worth distributing, so they are counted by put() as
+    // usual, as are sparse matrices and those too big to copy for each thread
+    blockCounted = (nThreads > 1 && count > 1 && dense && counts.size() <= maxDenseBytes / sizeof(size_t) / nThreads);
+    if (!blockCounted)
+        return;
+    
+    std::vector<const Streamline *> elements;
+    for (const_iterator it=begin; it!=end; it++)
+        elements.push_back(&(*it));
+    if (shards.size() < static_cast<size_t>(nThreads))
+        shards.resize(nThreads);
+    std::string errorMessage;
     
-    for (std::map<int,size_t>::const_iterator it=counts.begin(); it!=counts.end(); it++)
+    #pragma omp parallel num_threads(nThreads)
     {
-        labels.push_back(it->first);
-        labelCounts.push_back(it->second);
+#ifdef _OPENMP
+        std::vector<size_t> &shard = shards[omp_get_thread_num()];
+#else
+        std::vector<size_t> &shard = shards[0];
+#endif
+        if (shard.empty())
+            shard.resize(counts.size(), 0);
+        
+        #pragma omp for schedule(static)
+        for (long j=0; j<static_cast<long>(elements.size()); j++)
+        {
+            // Exceptions can't propagate out of the parallel region
+            try
+            {
+                add(*elements[j], shard);
+            }
+            catch (std::exception &e)
+            {
+                #pragma omp critical
+                errorMessage = e.what();
+            }
+        }
     }
     
-    SEXP labelsR = Rcpp::wrap(labels);
-    SEXP labelCountsR = Rcpp::wrap(labelCounts);
+    if (!errorMessage.empty())
+        throw std::runtime_error(errorMessage);
+}
+
+void ProfileMatrixDataSink::put (const Streamline &data)
+{
+    // The block has already been dealt with in parallel
+    if (blockCounted)
+        return;
+    else if (dense)
+        add(data, counts);
+    else
+    {
+        const std::set<int> &labels = data.getLabels();
+        if (labels.empty())
+            return;
+        std::map<int,size_t> &rowCounts = sparseCounts[rowIndex(data)];
+        for (std::set<int>::const_iterator it=labels.begin(); it!=labels.end(); it++)
+            rowCounts[*it]++;
+    }
+}
+
+std::map<int,size_t> ProfileMatrixDataSink::getCounts (const size_t row)
+{
+    if (row >= nRows())
+        throw std::runtime_error("Profile matrix row is out of range");
+    
+    if (!dense)
+        return sparseCounts[row];
+    
+    reduce();
+    std::map<int,size_t> result;
+    const size_t rowStart = row * nLabels;
+    for (int i=0; i<nLabels; i++)
+    {
+        if (counts[rowStart + i] > 0)
+            result[minLabel + i] = counts[rowStart + i];
+    }
+    return result;
+}
+
+void ProfileMatrixDataSink::saveState (BinaryOutputStream &stream)
+{
+    reduce();
+    stream.writeValue<int32_t>(minLabel);
+    stream.writeValue<int32_t>(nLabels);
+    stream.writeValue<uint64_t>(nSeeds);
+    for (size_t i=0; i<counts.size(); i++)
+        stream.writeValue<uint64_t>(counts[i]);
     
-    function(labelsR, labelCountsR);
+    // Sparse rows are written as their lengths followed by label-count pairs
+    for (size_t i=0; i<sparseCounts.size(); i++)
+    {
+        stream.writeValue<uint64_t>(sparseCounts[i].size());
+        for (std::map<int,size_t>::const_iterator it=sparseCounts[i].begin(); it!=sparseCounts[i].end(); it++)
+        {
+            stream.writeValue<int32_t>(it->first);
+            stream.writeValue<uint64_t>(it->second);
+        }
+    }
+}
+
+void ProfileMatrixDataSink::restoreState (BinaryInputStream &stream)
+{
+    shards.clear();
+    const int checkpointMinLabel = stream.readValue<int32_t>();
+    const int checkpointLabels = stream.readValue<int32_t>();
+    const size_t checkpointSeeds = stream.readValue<uint64_t>();
+    if (checkpointMinLabel != minLabel || checkpointLabels != nLabels || checkpointSeeds != nSeeds)
+        throw std::runtime_error("Checkpointed profile matrix does not match the current targets and seeds");
+    for (size_t i=0; i<counts.size(); i++)
+        counts[i] = stream.readValue<uint64_t>();
+    
+    for (size_t i=0; i<sparseCounts.size(); i++)
+    {
+        sparseCounts[i].clear();
+        const size_t n = stream.readValue<uint64_t>();
+        for (size_t j=0; j<n; j++)
+        {
+            const int label = stream.readValue<int32_t>();
+            sparseCounts[i][label] = stream.readValue<uint64_t>();
+        }
+    }
+}
+
+void ProfileMatrixDataSink::done ()
+{
+    reduce();
+    if (function == NULL)
+        return;
+    
+    // The function is called once per row, with the nonzero counts only
+    for (size_t row=0; row<nRows(); row++)
+    {
+        const std::map<int,size_t> rowCounts = getCounts(row);
+        std::vector<int> labels;
+        std::vector<size_t> labelCounts;
+        for (std::map<int,size_t>::const_iterator it=rowCounts.begin(); it!=rowCounts.end(); it++)
+        {
+            labels.push_back(it->first);
+            labelCounts.push_back(it->second);
+        }
+        
+        SEXP labelsR = Rcpp::wrap(labels);
+        SEXP labelCountsR = Rcpp::wrap(labelCounts);
+        
+        (*function)(labelsR, labelCountsR);
+    }
 }
@@ -5,6 +5,7 @@
 
 #include "DataSource.h"
 #include "Streamline.h"
+#include "Checkpoint.h"
 
 class RCallbackDataSink : public DataSink<Streamline>
 {
@@ -18,18 +19,81 @@ public:
     void put (const Streamline &data);
 };
 
-class ProfileMatrixDataSink : public DataSink<Streamline>
+// Pass each block of streamlines to an R function in one call, to avoid the
+// overhead of calling back into R for every streamline. The block is given
+// as a list containing one matrix of points, with the streamlines stacked
+// in order, and compressed-row offsets locating each streamline's points
+// and labels. Any per-point scalars are given in a matrix parallel to the
+// points, and properties with one row per streamline
+class BatchedRCallbackDataSink : public DataSink<Streamline>
 {
 private:
     Rcpp::Function function;
-    std::map<int,size_t> counts;
     
 public:
-    ProfileMatrixDataSink (const Rcpp::Function &function)
+    BatchedRCallbackDataSink (const Rcpp::Function &function)
         : function(function) {}
     
+    void setup (const size_type &count, const_iterator begin, const_iterator end);
+};
+
+// Count the streamlines reaching each target label; the counts are passed to
+// an R function at the end, if one is given, or can be retrieved afterwards.
+// Target labels lie in a known range, so counts are kept in a dense array,
+// optionally with one row per seed, and labels outside the range are an
+// error. With several threads, each block is counted in parallel, with each
+// thread using its own copy of the array. A matrix too big to hold densely
+// is instead kept as a map per row, which accepts any label, and is counted
+// serially
+class ProfileMatrixDataSink : public DataSink<Streamline>, public Checkpointable
+{
+private:
+    // The most memory the dense array, or its per-thread copies, may use (256 MiB)
+    static const size_t maxDenseBytes = 268435456;
+    
+    Rcpp::Function *function;
+    int minLabel, nLabels;
+    size_t nSeeds;
+    bool dense;
+    
+    // Counts for label l and seed s (or row zero, if not per seed) are at
+    // element s * nLabels + (l - minLabel)
+    std::vector<size_t> counts;
+    std::vector< std::map<int,size_t> > sparseCounts;
+    
+    int nThreads;
+    bool blockCounted;
+    std::vector< std::vector<size_t> > shards;
+    
+    size_t rowIndex (const Streamline &data) const;
+    void add (const Streamline &data, std::vector<size_t> &counts) const;
+    void reduce ();
+    
+public:
+    // Profiles are kept per seed if nSeeds is positive
+    ProfileMatrixDataSink (const int minLabel, const int maxLabel, const size_t nSeeds = 0, Rcpp::Function * const function = NULL)
+        : function(function), minLabel(minLabel), nLabels(std::max(maxLabel - minLabel + 1, 0)), nSeeds(nSeeds), nThreads(1), blockCounted(false)
+    {
+        dense = (nRows() * nLabels <= maxDenseBytes / sizeof(size_t));
+        if (dense)
+            counts.resize(nRows() * nLabels, 0);
+        else
+            sparseCounts.resize(nRows());
+    }
+    
+    void setThreads (const int nThreads) { this->nThreads = std::max(nThreads, 1); }
+    
+    void setup (const size_type &count, const_iterator begin, const_iterator end);
     void put (const Streamline &data);
     void done ();
+    
+    size_t nRows () const { return std::max(nSeeds, size_t(1)); }
+    
+    // The nonzero counts for one row, i.e. one seed if profiles are per seed
+    std::map<int,size_t> getCounts (const size_t row = 0);
+    
+    void saveState (BinaryOutputStream &stream);
+    void restoreState (BinaryInputStream &stream);
 };
 
 #endif
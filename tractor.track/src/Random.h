@@ -0,0 +1,62 @@
+#ifndef _RANDOM_H_
+#define _RANDOM_H_
+
+#include <RcppEigen.h>
+
+// Source of uniform random numbers: by default this wraps R's generator, but
+// that can't be used from multiple threads. The alternative is a
+// counter-based generator, whose output depends only on a key, a stream
+// number (typically a streamline index) and the number of draws within the
+// stream, so results are reproducible regardless of thread scheduling
+class RandomGenerator
+{
+private:
+    bool useR;
+    uint64_t key, stream, counter;
+    
+    // SplitMix64 finaliser: a fast, well-mixed bijection on 64-bit integers
+    static uint64_t mix (uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+        return x ^ (x >> 31);
+    }
+    
+public:
+    RandomGenerator ()
+        : useR(true), key(0), stream(0), counter(0) {}
+    
+    RandomGenerator (const uint64_t key)
+        : useR(false), key(key), stream(0), counter(0) {}
+    
+    // Create a key from R's generator, so that set.seed() still gives reproducible results
+    static uint64_t keyFromR ()
+    {
+        const uint64_t upper = static_cast<uint64_t>(R::unif_rand() * 4294967296.0);
+        const uint64_t lower = static_cast<uint64_t>(R::unif_rand() * 4294967296.0);
+        return (upper << 32) | lower;
+    }
+    
+    bool usesR () const { return useR; }
+    uint64_t getKey () const { return key; }
+    uint64_t getStream () const { return stream; }
+    uint64_t getCounter () const { return counter; }
+    
+    void setStream (const uint64_t stream, const uint64_t counter = 0)
+    {
+        this->stream = stream;
+        this->counter = counter;
+    }
+    
+    // Uniform deviate on the open interval (0,1), like R's unif_rand()
+    double uniform ()
+    {
+        if (useR)
+            return R::unif_rand();
+        
+        const uint64_t value = mix(mix(key ^ mix(stream)) + (++counter) * UINT64_C(0x9e3779b97f4a7c15));
+        return (static_cast<double>(value >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+    }
+};
+
+#endif
@@ -0,0 +1,239 @@
+#include <RcppEigen.h>
+
+#include "Sampling.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+ScalarSamplingDataSink::ScalarSamplingDataSink (const std::vector< Array<float> > &images, const Interpolation interpolation, const Reduction reduction)
+    : images(images), interpolation(interpolation), reduction(reduction), nThreads(1)
+{
+    if (images.empty())
+        throw std::invalid_argument("At least one image must be given for sampling");
+    
+    dims = images[0].getDimensions();
+    if (dims.size() != 3)
+        throw std::invalid_argument("Sampled images must be three-dimensional");
+    for (size_t i=1; i<images.size(); i++)
+    {
+        if (images[i].getDimensions() != dims)
+            throw std::invalid_argument("Sampled images must all have the same dimensions");
+    }
+    
+    const size_t n = images.size();
+    means.resize(n);
+    leftSums.resize(n);
+    rightSums.resize(n);
+    leftCounts.resize(n);
+    rightCounts.resize(n);
+    if (reduction == VoxelReduction)
+    {
+        voxelSums.resize(images[0].size() * n, 0.0);
+        voxelWeights.resize(images[0].size() * n, 0.0);
+    }
+}
+
+// Sample all images at one point, returning the index of the voxel
+// containing it, or -1 (with NaN values) if it's outside the images
+ptrdiff_t ScalarSamplingDataSink::sample (const Space<3>::Point &point, double * const values) const
+{
+    int loc[3];
+    for (int i=0; i<3; i++)
+    {
+        loc[i] = static_cast<int>(round(point[i]));
+        if (loc[i] < 0 || loc[i] >= dims[i])
+        {
+            for (size_t j=0; j<images.size(); j++)
+                values[j] = NAN;
+            return -1;
+        }
+    }
+    
+    const size_t index = loc[0] + dims[0] * (loc[1] + static_cast<size_t>(dims[1]) * loc[2]);
+    if (interpolation == NearestInterpolation)
+    {
+        for (size_t j=0; j<images.size(); j++)
+            values[j] = images[j][index];
+    }
+    else
+    {
+        // Neighbours beyond the edge of the image are clamped to it
+        int lower[3], upper[3];
+        double weights[3];
+        for (int i=0; i<3; i++)
+        {
+            const double base = floor(point[i]);
+            weights[i] = point[i] - base;
+            lower[i] = std::min(std::max(static_cast<int>(base), 0), dims[i] - 1);
+            upper[i] = std::min(std::max(static_cast<int>(base) + 1, 0), dims[i] - 1);
+        }
+        
+        for (size_t j=0; j<images.size(); j++)
+        {
+            const Array<float> &image = images[j];
+            double value = 0.0;
+            for (int k=0; k<8; k++)
+            {
+                double weight = 1.0;
+                int corner[3];
+                for (int i=0; i<3; i++)
+                {
+                    const bool high = ((k >> i) & 1);
+                    corner[i] = (high ? upper[i] : lower[i]);
+                    weight *= (high ? weights[i] : 1.0 - weights[i]);
+                }
+                if (weight > 0.0)
+                    value += weight * image[corner[0] + dims[0] * (corner[1] + static_cast<size_t>(dims[1]) * corner[2])];
+            }
+            values[j] = value;
+        }
+    }
+    
+    return static_cast<ptrdiff_t>(index);
+}
+
+// Sample the points in order, from the left end to the right; the seed is
+// the first point on both sides, so it is only included once
+void ScalarSamplingDataSink::sampleStreamline (const Streamline &data, std::vector<double> &samples, std::vector<ptrdiff_t> &voxels, size_t &seed) const
+{
+    const std::vector<Space<3>::Point> &leftPoints = data.getLeftPoints();
+    const std::vector<Space<3>::Point> &rightPoints = data.getRightPoints();
+    const size_t nLeft = leftPoints.size(), nRight = rightPoints.size();
+    const size_t n = images.size();
+    
+    samples.clear();
+    voxels.clear();
+    seed = (nLeft > 0 ? nLeft - 1 : 0);
+    for (size_t i=0; i<nLeft+nRight; i++)
+    {
+        if (i == nLeft && nLeft > 0)
+            continue;
+        const Space<3>::Point &point = (i < nLeft ? leftPoints[nLeft-i-1] : rightPoints[i-nLeft]);
+        samples.resize(samples.size() + n);
+        voxels.push_back(sample(point, &samples[samples.size() - n]));
+    }
+}
+
+void ScalarSamplingDataSink::reduce (const std::vector<double> &samples, const std::vector<ptrdiff_t> &voxels, const size_t seed)
+{
+    const size_t n = images.size();
+    const size_t nPoints = voxels.size();
+    
+    for (size_t j=0; j<n; j++)
+    {
+        double sum = 0.0;
+        size_t count = 0;
+        for (size_t p=0; p<nPoints; p++)
+        {
+            const double value = samples[p*n + j];
+            
+            // Profiles are extended even for missing values, so that they
+            // have the same extent for every image
+            if (reduction == ProfileReduction)
+            {
+                std::vector<double> &sums = (p < seed ? leftSums[j] : rightSums[j]);
+                std::vector<size_t> &counts = (p < seed ? leftCounts[j] : rightCounts[j]);
+                const size_t distance = (p < seed ? seed - p : p - seed);
+                if (sums.size() <= distance)
+                {
+                    sums.resize(distance + 1, 0.0);
+                    counts.resize(distance + 1, 0);
+                }
+                if (!std::isnan(value))
+                {
+                    sums[distance] += value;
+                    counts[distance]++;
+                }
+            }
+            
+            if (std::isnan(value))
+                continue;
+            sum += value;
+            count++;
+        }
+        
+        const double mean = (count > 0 ? sum / count : NAN);
+        if (reduction == StreamlineMeanReduction)
+            means[j].push_back(mean);
+        else if (reduction == VoxelReduction && count > 0)
+        {
+            const size_t offset = j * images[0].size();
+            for (size_t p=0; p<nPoints; p++)
+            {
+                if (voxels[p] >= 0)
+                {
+                    voxelSums[offset + voxels[p]] += mean;
+                    voxelWeights[offset + voxels[p]] += 1.0;
+                }
+            }
+        }
+    }
+}
+
+void ScalarSamplingDataSink::setup (const size_type &count, const_iterator begin, const_iterator end)
+{
+    std::vector<const Streamline *> elements;
+    for (const_iterator it=begin; it!=end; it++)
+        elements.push_back(&(*it));
+    
+    blockSamples.resize(elements.size());
+    blockVoxels.resize(elements.size());
+    blockSeeds.resize(elements.size());
+    std::string errorMessage;
+    
+    #pragma omp parallel for num_threads(nThreads) schedule(dynamic,16)
+    for (long j=0; j<static_cast<long>(elements.size()); j++)
+    {
+        // Exceptions can't propagate out of the parallel region
+        try
+        {
+            sampleStreamline(*elements[j], blockSamples[j], blockVoxels[j], blockSeeds[j]);
+        }
+        catch (std::exception &e)
+        {
+            #pragma omp critical
+            errorMessage = e.what();
+        }
+    }
+    
+    if (!errorMessage.empty())
+        throw std::runtime_error(errorMessage);
+    
+    for (size_t j=0; j<elements.size(); j++)
+        reduce(blockSamples[j], blockVoxels[j], blockSeeds[j]);
+}
+
+size_t ScalarSamplingDataSink::getProfile (const size_t image, std::vector<double> &profileMeans, std::vector<size_t> &profileCounts) const
+{
+    const std::vector<double> &left = leftSums[image], &right = rightSums[image];
+    const std::vector<size_t> &nLeft = leftCounts[image], &nRight = rightCounts[image];
+    
+    // Left distances start at one, so the seed is at the position after them
+    const size_t seed = (left.empty() ? 0 : left.size() - 1);
+    profileMeans.clear();
+    profileCounts.clear();
+    for (size_t i=left.size(); i>1; i--)
+    {
+        profileMeans.push_back(nLeft[i-1] > 0 ? left[i-1] / nLeft[i-1] : NAN);
+        profileCounts.push_back(nLeft[i-1]);
+    }
+    for (size_t i=0; i<right.size(); i++)
+    {
+        profileMeans.push_back(nRight[i] > 0 ? right[i] / nRight[i] : NAN);
+        profileCounts.push_back(nRight[i]);
+    }
+    return seed;
+}
+
+void ScalarSamplingDataSink::getVoxelMeans (const size_t image, std::vector<double> &voxelMeans) const
+{
+    if (reduction != VoxelReduction)
+        throw std::runtime_error("Voxelwise means were not requested");
+    
+    const size_t nVoxels = images[0].size();
+    const size_t offset = image * nVoxels;
+    voxelMeans.resize(nVoxels);
+    for (size_t i=0; i<nVoxels; i++)
+        voxelMeans[i] = (voxelWeights[offset + i] > 0.0 ? voxelSums[offset + i] / voxelWeights[offset + i] : 0.0);
+}
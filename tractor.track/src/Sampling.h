@@ -0,0 +1,74 @@
+#ifndef _SAMPLING_H_
+#define _SAMPLING_H_
+
+#include "DataSource.h"
+#include "Streamline.h"
+#include "Array.h"
+
+// Along-tract sampling: one or more scalar images are sampled at each point
+// of each streamline, and the samples are reduced to a mean per streamline,
+// a mean at each position relative to the seed point (negative on the left,
+// positive on the right), or a mean per voxel. In the last case each
+// streamline's mean is added to every voxel it visits, weighted by the
+// number of its points in that voxel. Points outside the images, and NaN
+// image values, are ignored. With several threads, the points of each block
+// are sampled in parallel, but the samples are always reduced in streamline
+// order, so the results don't depend on the number of threads
+class ScalarSamplingDataSink : public DataSink<Streamline>
+{
+public:
+    enum Interpolation { NearestInterpolation, TrilinearInterpolation };
+    enum Reduction { StreamlineMeanReduction, ProfileReduction, VoxelReduction };
+    
+private:
+    std::vector< Array<float> > images;
+    std::vector<int> dims;
+    Interpolation interpolation;
+    Reduction reduction;
+    int nThreads;
+    
+    // Results, one vector per image: means are per streamline, while profile
+    // sums and counts are indexed by distance from the seed on each side
+    std::vector< std::vector<double> > means;
+    std::vector< std::vector<double> > leftSums, rightSums;
+    std::vector< std::vector<size_t> > leftCounts, rightCounts;
+    
+    // Voxelwise sums and weights, with one volume per image
+    std::vector<double> voxelSums, voxelWeights;
+    
+    // Samples for the current block, with the values for all images at each
+    // point stored together, and the voxel containing each point (or -1)
+    std::vector< std::vector<double> > blockSamples;
+    std::vector< std::vector<ptrdiff_t> > blockVoxels;
+    std::vector<size_t> blockSeeds;
+    
+    ptrdiff_t sample (const Space<3>::Point &point, double * const values) const;
+    void sampleStreamline (const Streamline &data, std::vector<double> &samples, std::vector<ptrdiff_t> &voxels, size_t &seed) const;
+    void reduce (const std::vector<double> &samples, const std::vector<ptrdiff_t> &voxels, const size_t seed);
+    
+    // Hide default constructor
+    ScalarSamplingDataSink () {}
+    
+public:
+    // The images must all have the same dimensions, and be aligned with the streamline grid
+    ScalarSamplingDataSink (const std::vector< Array<float> > &images, const Interpolation interpolation = NearestInterpolation, const Reduction reduction = StreamlineMeanReduction);
+    
+    void setThreads (const int nThreads) { this->nThreads = std::max(nThreads, 1); }
+    
+    void setup (const size_type &count, const_iterator begin, const_iterator end);
+    
+    size_t nImages () const { return images.size(); }
+    const std::vector<int> & getDimensions () const { return dims; }
+    
+    // Mean sampled value of each image along each streamline, in order
+    const std::vector<double> & getMeans (const size_t image) const { return means[image]; }
+    
+    // Profiles, from the furthest left position to the furthest right, with
+    // the seed at the position given by the return value
+    size_t getProfile (const size_t image, std::vector<double> &profileMeans, std::vector<size_t> &profileCounts) const;
+    
+    // Voxelwise means, zero in voxels not visited
+    void getVoxelMeans (const size_t image, std::vector<double> &voxelMeans) const;
+};
+
+#endif
@@ -32,6 +32,23 @@ double Streamline::getLength (const std::vector<Space<3>::Point> &points) const
     }
 }
 
+void Streamline::calculateBounds () const
+{
+    lowerBound.setConstant(std::numeric_limits<float>::infinity());
+    upperBound.setConstant(-std::numeric_limits<float>::infinity());
+    for (size_t i=0; i<leftPoints.size(); i++)
+    {
+        lowerBound = lowerBound.min(leftPoints[i]);
+        upperBound = upperBound.max(leftPoints[i]);
+    }
+    for (size_t i=0; i<rightPoints.size(); i++)
+    {
+        lowerBound = lowerBound.min(rightPoints[i]);
+        upperBound = upperBound.max(rightPoints[i]);
+    }
+    boundsValid = true;
+}
+
 void Streamline::trim (std::vector<Space<3>::Point> &points, const double maxLength)
 {
     const size_t nPoints = points.size();
@@ -67,6 +84,93 @@ void Streamline::trim (std::vector<Space<3>::Point> &points, const double maxLen
     }
 }
 
+// Douglas-Peucker simplification of one side, which starts at the seed. Each
+// span is split at the point furthest from the segment joining its ends, if
+// that is further away than the tolerance; otherwise its interior points go
+bool Streamline::simplify (std::vector<Space<3>::Point> &points, std::vector<float> &scalars, const double tolerance) const
+{
+    const size_t nPoints = points.size();
+    if (nPoints < 3)
+        return false;
+    
+    // Distances are measured in world units
+    const Space<3>::Point scale = (pointType == VoxelPointType ? voxelDims : Space<3>::Point::Ones());
+    const double toleranceSquared = tolerance * tolerance;
+    
+    std::vector<bool> keep(nPoints, false);
+    keep[0] = keep[nPoints-1] = true;
+    std::vector< std::pair<size_t,size_t> > spans(1, std::make_pair(size_t(0), nPoints-1));
+    while (!spans.empty())
+    {
+        const size_t first = spans.back().first, last = spans.back().second;
+        spans.pop_back();
+        if (last - first < 2)
+            continue;
+        
+        const Eigen::Vector3d segment = ((points[last] - points[first]) * scale).matrix().cast<double>();
+        const double segmentLengthSquared = segment.squaredNorm();
+        double maxDistanceSquared = -1.0;
+        size_t furthest = first;
+        for (size_t i=first+1; i<last; i++)
+        {
+            // Distance to the nearest point on the segment, or to its start if it has no length
+            const Eigen::Vector3d offset = ((points[i] - points[first]) * scale).matrix().cast<double>();
+            double distanceSquared;
+            if (segmentLengthSquared > 0.0)
+            {
+                const double t = std::min(std::max(offset.dot(segment) / segmentLengthSquared, 0.0), 1.0);
+                distanceSquared = (offset - t * segment).squaredNorm();
+            }
+            else
+                distanceSquared = offset.squaredNorm();
+            
+            if (distanceSquared > maxDistanceSquared)
+            {
+                maxDistanceSquared = distanceSquared;
+                furthest = i;
+            }
+        }
+        
+        if (maxDistanceSquared > toleranceSquared)
+        {
+            keep[furthest] = true;
+            spans.push_back(std::make_pair(first, furthest));
+            spans.push_back(std::make_pair(furthest, last));
+        }
+    }
+    
+    // Compact the kept points, and their scalars, in place
+    size_t nKept = 0;
+    for (size_t i=0; i<nPoints; i++)
+    {
+        if (!keep[i])
+            continue;
+        points[nKept] = points[i];
+        if (scalarsPerPoint > 0)
+            std::copy(scalars.begin() + i*scalarsPerPoint, scalars.begin() + (i+1)*scalarsPerPoint, scalars.begin() + nKept*scalarsPerPoint);
+        nKept++;
+    }
+    
+    if (nKept == nPoints)
+        return false;
+    points.resize(nKept);
+    scalars.resize(nKept * scalarsPerPoint);
+    return true;
+}
+
+void Streamline::simplify (const double tolerance)
+{
+    const bool leftChanged = simplify(leftPoints, leftScalars, tolerance);
+    const bool rightChanged = simplify(rightPoints, rightScalars, tolerance);
+    
+    // Points are no longer evenly spaced if any have been removed
+    if (leftChanged || rightChanged)
+    {
+        fixedSpacing = false;
+        invalidate();
+    }
+}
+
 size_t Streamline::concatenatePoints (Eigen::ArrayX3f &points) const
 {
     int nPoints = this->nPoints();
@@ -104,3 +208,48 @@ size_t Streamline::concatenatePoints (Eigen::ArrayX3f &points) const
     
     return getSeedIndex();
 }
+
+void Streamline::setScalars (const int scalarsPerPoint, const std::vector<float> &leftScalars, const std::vector<float> &rightScalars)
+{
+    if (scalarsPerPoint < 0 || leftScalars.size() != leftPoints.size() * scalarsPerPoint || rightScalars.size() != rightPoints.size() * scalarsPerPoint)
+        throw std::runtime_error("Number of scalar values does not match the number of points");
+    
+    this->scalarsPerPoint = scalarsPerPoint;
+    this->leftScalars = leftScalars;
+    this->rightScalars = rightScalars;
+}
+
+size_t Streamline::concatenateScalars (Eigen::ArrayXXf &scalars) const
+{
+    int nPoints = this->nPoints();
+    if (nPoints < 1 || scalarsPerPoint == 0)
+    {
+        scalars.resize(std::max(nPoints,0), 0);
+        return getSeedIndex();
+    }
+    else
+        scalars.resize(nPoints, scalarsPerPoint);
+    
+    size_t index = 0;
+    for (size_t i=leftPoints.size(); i>1; i--, index++)
+    {
+        for (int j=0; j<scalarsPerPoint; j++)
+            scalars(index,j) = leftScalars[(i-1)*scalarsPerPoint + j];
+    }
+    
+    if (rightPoints.size() > 0)
+    {
+        for (size_t i=0; i<rightPoints.size(); i++, index++)
+        {
+            for (int j=0; j<scalarsPerPoint; j++)
+                scalars(index,j) = rightScalars[i*scalarsPerPoint + j];
+        }
+    }
+    else
+    {
+        for (int j=0; j<scalarsPerPoint; j++)
+            scalars(index,j) = leftScalars[j];
+    }
+    
+    return getSeedIndex();
+}
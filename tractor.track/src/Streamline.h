@@ -23,7 +23,7 @@ private:
     Streamline::PointType pointType;
     
     // Voxel dimensions, needed for converting between voxel and world point types
-    Eigen::ArrayXf voxelDims;
+    Eigen::Array3f voxelDims;
     
     // A set of integer labels associated with the streamline, indicating, for
     // example, the anatomical regions that the streamline passes through
@@ -32,6 +32,34 @@ private:
     // Reasons for termination on each side
     Streamline::TerminationReason leftTerminationReason, rightTerminationReason;
     
+    // The number of the seed the streamline was generated from, if known (otherwise -1)
+    int seedNumber;
+    
+    // Scalar values associated with each point, with a fixed number per
+    // point, stored alongside the points on each side (so the seed's values
+    // appear on both sides)
+    int scalarsPerPoint;
+    std::vector<float> leftScalars, rightScalars;
+    
+    // Additional numeric properties of the streamline as a whole
+    std::vector<float> properties;
+    
+    // Quantities derived from the points, calculated when first needed and
+    // discarded when the points change: a negative length or false flag
+    // means that the value has to be recalculated. As with other
+    // modifications, the first calls for each object shouldn't be concurrent
+    mutable double leftLength, rightLength;
+    mutable bool boundsValid;
+    mutable Space<3>::Point lowerBound, upperBound;
+    
+    void invalidate ()
+    {
+        leftLength = rightLength = -1.0;
+        boundsValid = false;
+    }
+    
+    void calculateBounds () const;
+    
 protected:
     // A boolean value indicating whether or not the points are equally spaced
     // (in real-world terms)
@@ -39,27 +67,73 @@ protected:
     
     double getLength (const std::vector<Space<3>::Point> &points) const;
     void trim (std::vector<Space<3>::Point> &points, const double maxLength);
+    bool simplify (std::vector<Space<3>::Point> &points, std::vector<float> &scalars, const double tolerance) const;
     
 public:
-    Streamline () {}
-    Streamline (const std::vector<Space<3>::Point> &leftPoints, const std::vector<Space<3>::Point> &rightPoints, const Streamline::PointType pointType, const Eigen::VectorXf &voxelDims, const bool fixedSpacing)
-        : leftPoints(leftPoints), rightPoints(rightPoints), pointType(pointType), voxelDims(voxelDims), fixedSpacing(fixedSpacing), leftTerminationReason(UnknownReason), rightTerminationReason(UnknownReason) {}
+    Streamline ()
+        : pointType(VoxelPointType), voxelDims(Eigen::Array3f::Ones()), leftTerminationReason(UnknownReason), rightTerminationReason(UnknownReason), seedNumber(-1), scalarsPerPoint(0), leftLength(-1.0), rightLength(-1.0), boundsValid(false), fixedSpacing(false) {}
+    Streamline (const std::vector<Space<3>::Point> &leftPoints, const std::vector<Space<3>::Point> &rightPoints, const Streamline::PointType pointType, const Eigen::Array3f &voxelDims, const bool fixedSpacing)
+        : leftPoints(leftPoints), rightPoints(rightPoints), pointType(pointType), voxelDims(voxelDims), fixedSpacing(fixedSpacing), leftTerminationReason(UnknownReason), rightTerminationReason(UnknownReason), seedNumber(-1), scalarsPerPoint(0), leftLength(-1.0), rightLength(-1.0), boundsValid(false) {}
     
-    size_t nPoints () const { return std::max(static_cast<size_t>(leftPoints.size()+rightPoints.size())-1, size_t(0)); }
-    size_t getSeedIndex () const { return std::max(static_cast<size_t>(leftPoints.size())-1, size_t(0)); }
+    // The seed appears on both sides, so is only counted once
+    size_t nPoints () const { return (leftPoints.empty() && rightPoints.empty() ? 0 : leftPoints.size() + rightPoints.size() - 1); }
+    size_t getSeedIndex () const { return (leftPoints.empty() ? 0 : leftPoints.size() - 1); }
     
     const std::vector<Space<3>::Point> & getLeftPoints () const { return leftPoints; }
     const std::vector<Space<3>::Point> & getRightPoints () const { return rightPoints; }
     Streamline::PointType getPointType () const { return pointType; }
     bool usesFixedSpacing () const { return fixedSpacing; }
     
-    const Eigen::ArrayXf & getVoxelDimensions () const { return voxelDims; }
+    const Eigen::Array3f & getVoxelDimensions () const { return voxelDims; }
+    
+    // Lengths are in world units (typically mm), whatever the point type
+    double getLeftLength () const
+    {
+        if (leftLength < 0.0)
+            leftLength = getLength(leftPoints);
+        return leftLength;
+    }
+    
+    double getRightLength () const
+    {
+        if (rightLength < 0.0)
+            rightLength = getLength(rightPoints);
+        return rightLength;
+    }
+    
+    // The smallest and largest coordinates of the points, in their own units
+    const Space<3>::Point & getLowerBound () const
+    {
+        if (!boundsValid)
+            calculateBounds();
+        return lowerBound;
+    }
     
-    double getLeftLength () const  { return getLength(leftPoints); }
-    double getRightLength () const { return getLength(rightPoints); }
+    const Space<3>::Point & getUpperBound () const
+    {
+        if (!boundsValid)
+            calculateBounds();
+        return upperBound;
+    }
+    
+    // Scalars are trimmed along with the points
+    void trimLeft (const double maxLength)
+    {
+        trim(leftPoints, maxLength);
+        leftScalars.resize(leftPoints.size() * scalarsPerPoint);
+        invalidate();
+    }
+    void trimRight (const double maxLength)
+    {
+        trim(rightPoints, maxLength);
+        rightScalars.resize(rightPoints.size() * scalarsPerPoint);
+        invalidate();
+    }
     
-    void trimLeft (const double maxLength)  { trim(leftPoints,maxLength); }
-    void trimRight (const double maxLength) { trim(rightPoints,maxLength); }
+    // Remove points so that the path deviates from the original by no more
+    // than the tolerance (in world units). The seed and both ends are kept,
+    // so the seed index still locates the seed point
+    void simplify (const double tolerance);
     
     int nLabels () const                            { return static_cast<int>(labels.size()); }
     bool addLabel (const int label)                 { return labels.insert(label).second; }
@@ -77,7 +151,28 @@ public:
         rightTerminationReason = right;
     }
     
+    int getSeedNumber () const                  { return seedNumber; }
+    void setSeedNumber (const int seedNumber)   { this->seedNumber = seedNumber; }
+    
+    int nScalars () const                               { return scalarsPerPoint; }
+    const std::vector<float> & getLeftScalars () const  { return leftScalars; }
+    const std::vector<float> & getRightScalars () const { return rightScalars; }
+    void setScalars (const int scalarsPerPoint, const std::vector<float> &leftScalars, const std::vector<float> &rightScalars);
+    void clearScalars ()
+    {
+        scalarsPerPoint = 0;
+        leftScalars.clear();
+        rightScalars.clear();
+    }
+    
+    int nProperties () const                                { return static_cast<int>(properties.size()); }
+    const std::vector<float> & getProperties () const       { return properties; }
+    void setProperties (const std::vector<float> &properties) { this->properties = properties; }
+    
     size_t concatenatePoints (Eigen::ArrayX3f &points) const;
+    
+    // Scalars in the same order as the concatenated points, one row per point
+    size_t concatenateScalars (Eigen::ArrayXXf &scalars) const;
 };
 
 class StreamlineTruncator : public DataManipulator<Streamline>
@@ -95,6 +190,44 @@ public:
         data.trimRight(maxRightLength);
         return true;
     }
+    
+    bool threadSafe () const { return true; }
+};
+
+// Simplify streamlines to within a tolerance, keeping a count of the points
+// before and after
+class StreamlineSimplifier : public DataManipulator<Streamline>
+{
+private:
+    double tolerance;
+    size_t nStreamlines, pointsBefore, pointsAfter;
+    
+public:
+    StreamlineSimplifier (const double tolerance)
+        : tolerance(tolerance), nStreamlines(0), pointsBefore(0), pointsAfter(0) {}
+    
+    bool process (Streamline &data)
+    {
+        const size_t before = data.nPoints();
+        data.simplify(tolerance);
+        const size_t after = data.nPoints();
+        
+        // Streamlines may be processed in parallel
+        #pragma omp atomic
+        nStreamlines++;
+        #pragma omp atomic
+        pointsBefore += before;
+        #pragma omp atomic
+        pointsAfter += after;
+        return true;
+    }
+    
+    bool threadSafe () const { return true; }
+    
+    size_t getStreamlineCount () const { return nStreamlines; }
+    size_t getPointsBefore () const { return pointsBefore; }
+    size_t getPointsAfter () const { return pointsAfter; }
+    double getCompressionRatio () const { return (pointsAfter == 0 ? 1.0 : static_cast<double>(pointsBefore) / pointsAfter); }
 };
 
 class StreamlineLengthsDataSink : public DataSink<Streamline>
@@ -2,6 +2,10 @@
 
 #include "Tracker.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using namespace std;
 
 Streamline Tracker::run ()
@@ -15,20 +19,13 @@ Streamline Tracker::run ()
         spaceDims[i] = imageDims(i,0);
     const Eigen::Array3f voxelDims = model->getGrid3D().spacings();
     
-    Rcpp::Rcout << std::fixed;
-    Rcpp::Rcout.precision(3);
-    logger.debug1.indent() << "Tracking from seed point " << seed << endl;
-    
-    if (visited == NULL)
-    {
-        logger.debug2.indent() << "Creating visitation map" << endl;
-        visited = new Array<bool>(spaceDims, false);
-    }
-    else
+    // Copies may run in other threads, where R's output stream mustn't be touched
+    if (logger.getOutputLevel() > 0)
     {
-        logger.debug2.indent() << "Resetting visitation map" << endl;
-        visited->fill(false);
+        Rcpp::Rcout << std::fixed;
+        Rcpp::Rcout.precision(3);
     }
+    logger.debug1.indent() << "Tracking from seed point " << seed << endl;
     
     if (flags["loopcheck"] && loopcheck == NULL)
     {
@@ -53,7 +50,7 @@ Streamline Tracker::run ()
     if (jitter)
     {
         for (int i=0; i<3; i++)
-            currentSeed[i] += R::unif_rand() - 0.5;
+            currentSeed[i] += random.uniform() - 0.5;
     }
     
     int startTarget = 0;
@@ -104,7 +101,7 @@ Streamline Tracker::run ()
             }
             
             // Index for current location
-            visited->flattenIndex(roundedLoc, vectorLoc);
+            maskData->flattenIndex(roundedLoc, vectorLoc);
             
             // Stop if we've stepped outside the mask, possibly deferring termination if required
             if ((*maskData)[vectorLoc] == 0 && previouslyInsideMask == 1)
@@ -115,10 +112,6 @@ Streamline Tracker::run ()
             }
             previouslyInsideMask = ((*maskData)[vectorLoc] == 0 ? 0 : 1);
             
-            // Mark visit
-            if (!(*visited)[vectorLoc])
-                (*visited)[vectorLoc] = true;
-            
             // Store current (unrounded) location if required
             // NB: This part of the code must always be reached at the seed point
             if (dir == 0)
@@ -149,7 +142,7 @@ Streamline Tracker::run ()
             }
             
             // Sample a direction for the current step
-            Space<3>::Vector currentStep = model->sampleDirection(loc, previousStep);
+            Space<3>::Vector currentStep = model->sampleDirection(loc, previousStep, random);
             logger.debug3.indent() << "Sampled step direction is " << currentStep << endl;
             if (Space<3>::zeroVector(currentStep))
             {
@@ -220,3 +213,318 @@ Streamline Tracker::run ()
     streamline.setLabels(labels);
     return streamline;
 }
+
+void TractographyDataSource::setConvergence (const double tolerance, const size_t minStreamlines, const size_t batchSize, const ConvergenceMeasure measure)
+{
+    this->adaptive = (tolerance > 0.0);
+    this->tolerance = tolerance;
+    this->minStreamlines = minStreamlines;
+    this->batchSize = std::max(batchSize, size_t(1));
+    this->measure = measure;
+    
+    const Eigen::Array3i imageDims = tracker->getModel()->getGrid3D().dimensions();
+    dims.resize(3);
+    for (int i=0; i<3; i++)
+        dims[i] = imageDims(i,0);
+}
+
+void TractographyDataSource::updateHitCounts (const Streamline &data)
+{
+    // Each voxel or label is counted at most once per streamline
+    std::set<size_t> keys;
+    if (measure == ProfileConvergence)
+    {
+        const std::set<int> &labels = data.getLabels();
+        keys.insert(labels.begin(), labels.end());
+    }
+    else
+    {
+        const std::vector<Space<3>::Point> * const sides[2] = { &data.getLeftPoints(), &data.getRightPoints() };
+        std::vector<int> loc(3);
+        for (int s=0; s<2; s++)
+        {
+            for (size_t j=0; j<sides[s]->size(); j++)
+            {
+                for (int i=0; i<3; i++)
+                    loc[i] = static_cast<int>(round((*sides[s])[j][i]));
+                keys.insert(loc[0] + dims[0] * (loc[1] + dims[1] * loc[2]));
+            }
+        }
+    }
+    
+    for (std::set<size_t>::const_iterator it=keys.begin(); it!=keys.end(); it++)
+        batchHitCounts[*it]++;
+}
+
+bool TractographyDataSource::converged ()
+{
+    // Largest absolute change in hit proportion due to the latest batch
+    const double previousTotal = static_cast<double>(currentSeedStreamline - batchSize);
+    const double currentTotal = static_cast<double>(currentSeedStreamline);
+    double maxChange = 0.0;
+    
+    for (std::map<size_t,size_t>::const_iterator it=hitCounts.begin(); it!=hitCounts.end(); it++)
+    {
+        std::map<size_t,size_t>::const_iterator batchIt = batchHitCounts.find(it->first);
+        const size_t batchCount = (batchIt == batchHitCounts.end() ? 0 : batchIt->second);
+        const double change = fabs((it->second + batchCount) / currentTotal - it->second / previousTotal);
+        maxChange = std::max(maxChange, change);
+    }
+    for (std::map<size_t,size_t>::const_iterator it=batchHitCounts.begin(); it!=batchHitCounts.end(); it++)
+    {
+        if (hitCounts.count(it->first) == 0)
+            maxChange = std::max(maxChange, it->second / currentTotal);
+        hitCounts[it->first] += it->second;
+    }
+    batchHitCounts.clear();
+    
+    // The first batch has nothing to compare to, and nothing can be said to have converged if nothing has been hit
+    if (previousTotal == 0.0 || hitCounts.empty())
+        return false;
+    else
+        return (maxChange < tolerance);
+}
+
+void TractographyDataSource::setThreads (const int nThreads, const size_t chunkSize)
+{
+    this->nThreads = std::max(nThreads, 1);
+    this->chunkSize = std::max(chunkSize, size_t(1));
+    
+    for (size_t i=0; i<workers.size(); i++)
+        delete workers[i];
+    workers.clear();
+    
+    if (this->nThreads > 1)
+    {
+        // Each worker copies the tracker's counter-based generator, which TrackingJob always installs
+        // R's generator can't be used from worker threads
+        if (tracker->getRandomGenerator().usesR())
+            throw std::runtime_error("Parallel tracking requires the counter-based random number generator");
+        for (int i=0; i<this->nThreads; i++)
+            workers.push_back(new Tracker(*tracker));
+    }
+}
+
+void TractographyDataSource::record (const Streamline &data)
+{
+    currentStreamline++;
+    currentSeedStreamline++;
+    
+    bool seedFinished = (currentSeedStreamline >= streamlinesPerSeed);
+    if (adaptive)
+    {
+        updateHitCounts(data);
+        if (!seedFinished && currentSeedStreamline % batchSize == 0)
+            seedFinished = (converged() && currentSeedStreamline >= minStreamlines);
+    }
+    
+    if (seedFinished)
+    {
+        seedCounts.push_back(currentSeedStreamline);
+        currentSeed++;
+        currentSeedStreamline = 0;
+        hitCounts.clear();
+        batchHitCounts.clear();
+    }
+}
+
+void TractographyDataSource::get (Streamline &data)
+{
+    // We're not generating any more streamlines
+    if (!more())
+        return;
+    
+    // We're moving on to the next seed, or continuing with the rightwards vector from its first streamline
+    const bool first = (currentSeedStreamline == 0);
+    if (first)
+        tracker->setSeed(seeds.row(currentSeed), jitter);
+    else if (tracker->resetsRightwardsVector())
+        tracker->setSeedRightwardsVector(seedRightwardsVectors[currentSeed]);
+    
+    // With the counter-based generator, random numbers depend on the streamline index
+    if (!tracker->getRandomGenerator().usesR())
+        tracker->getRandomGenerator().setStream(currentStreamline);
+    
+    // Generate the streamline and update the counters
+    data = tracker->run();
+    data.setSeedNumber(static_cast<int>(currentSeed));
+    if (first)
+        seedRightwardsVectors[currentSeed] = tracker->getRightwardsVector();
+    record(data);
+}
+
+void TractographyDataSource::runJobs (const std::vector<size_t> &jobs, const std::vector<size_t> &jobSeeds, const std::vector<size_t> &jobIndices, std::vector<Streamline> &results)
+{
+    const bool perSeedRightwardsVector = tracker->resetsRightwardsVector();
+    std::string errorMessage;
+    
+    #pragma omp parallel for num_threads(nThreads) schedule(dynamic,chunkSize)
+    for (long k=0; k<static_cast<long>(jobs.size()); k++)
+    {
+#ifdef _OPENMP
+        Tracker *worker = workers[omp_get_thread_num()];
+#else
+        Tracker *worker = workers[0];
+#endif
+        
+        // Exceptions can't propagate out of the parallel region
+        try
+        {
+            const size_t j = jobs[k];
+            const size_t seed = jobSeeds[j];
+            worker->setSeed(seeds.row(seed), jitter);
+            if (perSeedRightwardsVector && jobIndices[j] > 0)
+                worker->setSeedRightwardsVector(seedRightwardsVectors[seed]);
+            worker->getRandomGenerator().setStream(currentStreamline + j);
+            
+            results[j] = worker->run();
+            results[j].setSeedNumber(static_cast<int>(seed));
+            
+            // The first streamline from each seed establishes the rightwards vector for the rest
+            if (perSeedRightwardsVector && jobIndices[j] == 0)
+                seedRightwardsVectors[seed] = worker->getRightwardsVector();
+        }
+        catch (std::exception &e)
+        {
+            #pragma omp critical
+            errorMessage = e.what();
+        }
+    }
+    
+    if (!errorMessage.empty())
+        throw std::runtime_error(errorMessage);
+}
+
+size_t TractographyDataSource::getBlock (std::list<Streamline> &block, const size_t n)
+{
+    if (nThreads < 2)
+        return DataSource<Streamline>::getBlock(block, n);
+    
+    // Plan the next streamlines as (seed, index within seed) pairs. In
+    // adaptive mode we can't look beyond the end of the current batch, since
+    // whether the seed continues depends on the streamlines within it
+    std::vector<size_t> jobSeeds, jobIndices;
+    size_t seed = currentSeed, seedStreamline = currentSeedStreamline;
+    while (jobSeeds.size() < n && seed < static_cast<size_t>(seeds.rows()) && streamlinesPerSeed > 0)
+    {
+        jobSeeds.push_back(seed);
+        jobIndices.push_back(seedStreamline);
+        seedStreamline++;
+        
+        if (seedStreamline >= streamlinesPerSeed)
+        {
+            seed++;
+            seedStreamline = 0;
+            if (adaptive)
+                break;
+        }
+        else if (adaptive && seedStreamline % batchSize == 0)
+            break;
+    }
+    
+    // Streamlines that establish a seed's rightwards vector must be run before
+    // the others from that seed, so there are two parallel phases
+    const size_t nJobs = jobSeeds.size();
+    std::vector<size_t> firstJobs, otherJobs;
+    for (size_t j=0; j<nJobs; j++)
+    {
+        if (jobIndices[j] == 0 && tracker->resetsRightwardsVector())
+            firstJobs.push_back(j);
+        else
+            otherJobs.push_back(j);
+    }
+    
+    std::vector<Streamline> results(nJobs);
+    if (!firstJobs.empty())
+        runJobs(firstJobs, jobSeeds, jobIndices, results);
+    if (!otherJobs.empty())
+        runJobs(otherJobs, jobSeeds, jobIndices, results);
+    
+    // Merge results in order, so output doesn't depend on the number of threads
+    for (size_t j=0; j<nJobs; j++)
+    {
+        block.push_back(results[j]);
+        record(results[j]);
+    }
+    
+    return nJobs;
+}
+
+// FNV-1a hash of the seed coordinates, used to check that a resumed run uses the same seeds
+static uint64_t hashSeeds (const Eigen::ArrayX3f &seeds)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(seeds.data());
+    for (size_t i=0; i<seeds.size()*sizeof(float); i++)
+        hash = (hash ^ bytes[i]) * UINT64_C(0x100000001b3);
+    return hash;
+}
+
+void TractographyDataSource::saveState (BinaryOutputStream &stream)
+{
+    if (tracker->getRandomGenerator().usesR())
+        throw std::runtime_error("Tracking state can only be saved when using the counter-based random number generator");
+    
+    stream.writeValue<uint64_t>(hashSeeds(seeds));
+    stream.writeValue<uint64_t>(currentStreamline);
+    stream.writeValue<uint64_t>(currentSeed);
+    stream.writeValue<uint64_t>(currentSeedStreamline);
+    
+    stream.writeValue<uint64_t>(seedCounts.size());
+    for (size_t i=0; i<seedCounts.size(); i++)
+        stream.writeValue<uint64_t>(seedCounts[i]);
+    
+    const std::map<size_t,size_t> *counts[2] = { &hitCounts, &batchHitCounts };
+    for (int i=0; i<2; i++)
+    {
+        stream.writeValue<uint64_t>(counts[i]->size());
+        for (std::map<size_t,size_t>::const_iterator it=counts[i]->begin(); it!=counts[i]->end(); it++)
+        {
+            stream.writeValue<uint64_t>(it->first);
+            stream.writeValue<uint64_t>(it->second);
+        }
+    }
+    
+    // The rightwards vector established for the current seed; earlier seeds are finished with
+    if (currentSeed < seedRightwardsVectors.size())
+        stream.writeVector<float>(seedRightwardsVectors[currentSeed]);
+    else
+        stream.writeVector<float>(tracker->getRightwardsVector());
+}
+
+void TractographyDataSource::restoreState (BinaryInputStream &stream)
+{
+    if (stream.readValue<uint64_t>() != hashSeeds(seeds))
+        throw std::runtime_error("Checkpointed tracking state does not match the current seeds");
+    
+    currentStreamline = stream.readValue<uint64_t>();
+    currentSeed = stream.readValue<uint64_t>();
+    currentSeedStreamline = stream.readValue<uint64_t>();
+    
+    seedCounts.resize(stream.readValue<uint64_t>());
+    for (size_t i=0; i<seedCounts.size(); i++)
+        seedCounts[i] = stream.readValue<uint64_t>();
+    
+    std::map<size_t,size_t> *counts[2] = { &hitCounts, &batchHitCounts };
+    for (int i=0; i<2; i++)
+    {
+        counts[i]->clear();
+        const size_t n = stream.readValue<uint64_t>();
+        for (size_t j=0; j<n; j++)
+        {
+            const size_t key = stream.readValue<uint64_t>();
+            (*counts[i])[key] = stream.readValue<uint64_t>();
+        }
+    }
+    
+    Space<3>::Vector rightwardsVector;
+    stream.readVector<float>(rightwardsVector);
+    
+    // Part-way through a seed, put the tracker(s) back into the state they were left in
+    if (currentSeedStreamline > 0 && more())
+    {
+        seedRightwardsVectors[currentSeed] = rightwardsVector;
+        if (nThreads < 2)
+            tracker->setSeed(seeds.row(currentSeed), jitter);
+    }
+}
@@ -9,6 +9,8 @@
 #include "Streamline.h"
 #include "DataSource.h"
 #include "Logger.h"
+#include "Random.h"
+#include "Checkpoint.h"
 
 #define LOOPCHECK_RATIO 5.0
 
@@ -17,11 +19,13 @@ class Tracker
 private:
     DiffusionModel *model;
     
+    // Copies share the mask and target data with the original, and don't own them
     Array<short> *maskData;
     Array<int> *targetData;
+    bool sharedData;
     
     Array<Space<3>::Vector> *loopcheck;
-    Array<bool> *visited;
+    RandomGenerator random;
     
     std::map<std::string,bool> flags;
     
@@ -38,24 +42,39 @@ private:
 public:
     Tracker () {}
     Tracker (DiffusionModel * const model)
-        : model(model), maskData(NULL), targetData(NULL), loopcheck(NULL), visited(NULL) {}
+        : model(model), maskData(NULL), targetData(NULL), sharedData(false), loopcheck(NULL) {}
+    
+    // Create a tracker with the same settings, which can run independently of
+    // the original (e.g. in another thread); debugging output is disabled
+    Tracker (const Tracker &other)
+        : model(other.model), maskData(other.maskData), targetData(other.targetData), sharedData(true), loopcheck(NULL), random(other.random), flags(other.flags), seed(other.seed), rightwardsVector(other.rightwardsVector), innerProductThreshold(other.innerProductThreshold), stepLength(other.stepLength), maxSteps(other.maxSteps), jitter(other.jitter), autoResetRightwardsVector(other.autoResetRightwardsVector)
+    {
+        logger.setOutputLevel(0);
+    }
     
     ~Tracker ()
     {
-        delete maskData;
-        delete targetData;
+        if (!sharedData)
+        {
+            delete maskData;
+            delete targetData;
+        }
         delete loopcheck;
-        delete visited;
     }
     
+    DiffusionModel * getModel () const { return model; }
     Space<3>::Point getSeed () const { return seed; }
     Space<3>::Vector getRightwardsVector () const { return rightwardsVector; }
     float getInnerProductThreshold () const { return innerProductThreshold; }
     float getStepLength () const { return stepLength; }
+    bool resetsRightwardsVector () const { return autoResetRightwardsVector; }
+    RandomGenerator & getRandomGenerator () { return random; }
+    const Array<int> * getTargetData () const { return targetData; }
     
     void setMask (const RNifti::NiftiImage &mask)
     {
-        delete maskData;
+        if (!sharedData)
+            delete maskData;
         maskData = getImageArray<short>(mask);
     }
     
@@ -70,7 +89,8 @@ public:
     
     void setTargets (const RNifti::NiftiImage &targets)
     {
-        delete targetData;
+        if (!sharedData)
+            delete targetData;
         targetData = getImageArray<int>(targets);
     }
     
@@ -81,6 +101,10 @@ public:
         this->autoResetRightwardsVector = Space<3>::zeroVector(rightwardsVector);
     }
     
+    // Set the rightwards vector for the current seed only, e.g. when it was established by another tracker
+    void setSeedRightwardsVector (const Space<3>::Vector &rightwardsVector) { this->rightwardsVector = rightwardsVector; }
+    
+    void setRandomGenerator (const RandomGenerator &random) { this->random = random; }
     void setInnerProductThreshold (const float innerProductThreshold) { this->innerProductThreshold = innerProductThreshold; }
     void setStepLength (const float stepLength) { this->stepLength = stepLength; }
     void setMaxSteps (const int maxSteps) { this->maxSteps = maxSteps; }
@@ -93,44 +117,72 @@ public:
     Streamline run ();
 };
 
-class TractographyDataSource : public DataSource<Streamline>
+class TractographyDataSource : public DataSource<Streamline>, public Checkpointable
 {
+public:
+    enum ConvergenceMeasure { VisitationConvergence, ProfileConvergence };
+    
 private:
     Tracker *tracker;
     Eigen::ArrayX3f seeds;
     bool jitter;
-    size_t streamlinesPerSeed, totalStreamlines, currentStreamline, currentSeed;
+    size_t streamlinesPerSeed, currentStreamline, currentSeed, currentSeedStreamline;
+    std::vector<size_t> seedCounts;
+    
+    // Adaptive sampling: streamlines are generated in batches, and tracking
+    // from a seed stops once the largest change in visitation (or target
+    // hit) proportion over a batch falls below the tolerance. In this mode
+    // streamlinesPerSeed is the maximum count
+    bool adaptive;
+    ConvergenceMeasure measure;
+    double tolerance;
+    size_t minStreamlines, batchSize;
+    std::vector<int> dims;
+    std::map<size_t,size_t> hitCounts, batchHitCounts;
+    
+    // Parallel tracking: each thread has its own copy of the tracker, and
+    // streamlines are handed out in small chunks, so that threads which draw
+    // short streamlines go on to take more work. Each streamline's random
+    // numbers depend only on its index, and results are kept in order
+    int nThreads;
+    size_t chunkSize;
+    std::vector<Tracker*> workers;
+    
+    // Unless one is given, the rightwards vector for each seed is the one
+    // established by its first streamline (which may be zero), whatever the
+    // number of threads
+    std::vector<Space<3>::Vector> seedRightwardsVectors;
+    
+    void updateHitCounts (const Streamline &data);
+    bool converged ();
+    void record (const Streamline &data);
+    void runJobs (const std::vector<size_t> &jobs, const std::vector<size_t> &jobSeeds, const std::vector<size_t> &jobIndices, std::vector<Streamline> &results);
     
 public:
     TractographyDataSource (Tracker * const tracker, const Eigen::ArrayX3f &seeds, const size_t streamlinesPerSeed, const bool jitter)
-        : tracker(tracker), seeds(seeds), streamlinesPerSeed(streamlinesPerSeed), jitter(jitter), currentStreamline(0), currentSeed(0)
+        : tracker(tracker), seeds(seeds), streamlinesPerSeed(streamlinesPerSeed), jitter(jitter), currentStreamline(0), currentSeed(0), currentSeedStreamline(0), adaptive(false), nThreads(1), chunkSize(1), seedRightwardsVectors(seeds.rows(), Space<3>::zeroVector()) {}
+    
+    ~TractographyDataSource ()
     {
-        this->totalStreamlines = seeds.rows() * streamlinesPerSeed;
+        for (size_t i=0; i<workers.size(); i++)
+            delete workers[i];
     }
     
-    bool more () { return (currentStreamline < totalStreamlines); }
+    void setThreads (const int nThreads, const size_t chunkSize = 4);
     
-    void get (Streamline &data)
-    {
-        // We're not generating any more streamlines
-        if (currentStreamline >= totalStreamlines)
-            return;
-        
-        // We're moving on to the next seed
-        if (currentStreamline % streamlinesPerSeed == 0)
-        {
-            if (currentStreamline > 0)
-                currentSeed++;
-            
-            tracker->setSeed(seeds.row(currentSeed), jitter);
-        }
-        
-        // Generate the streamline
-        data = tracker->run();
-        
-        // Increment the main counter
-        currentStreamline++;
-    }
+    void setConvergence (const double tolerance, const size_t minStreamlines, const size_t batchSize, const ConvergenceMeasure measure = VisitationConvergence);
+    
+    // Number of streamlines generated from each seed so far
+    const std::vector<size_t> & getSeedCounts () const { return seedCounts; }
+    
+    bool more () { return (currentSeed < static_cast<size_t>(seeds.rows()) && streamlinesPerSeed > 0); }
+    void get (Streamline &data);
+    size_t getBlock (std::list<Streamline> &block, const size_t n);
+    
+    // Resuming requires the counter-based random generator with the original
+    // key, since each streamline's random numbers then depend only on its index
+    void saveState (BinaryOutputStream &stream);
+    void restoreState (BinaryInputStream &stream);
 };
 
 #endif
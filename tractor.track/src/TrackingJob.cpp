@@ -0,0 +1,254 @@
+#include <RcppEigen.h>
+
+#include "Space.h"
+#include "RNifti.h"
+#include "Streamline.h"
+#include "Tracker.h"
+#include "Filter.h"
+#include "Trackvis.h"
+#include "VisitationMap.h"
+#include "Connectome.h"
+#include "RCallback.h"
+#include "Pipeline.h"
+#include "Checkpoint.h"
+#include "TrackingJob.h"
+
+// State of a tracking run outside its current pipeline: the random key, the
+// seed group in progress and the results from groups already completed
+class TrackingRunState : public Checkpointable
+{
+public:
+    uint64_t key;
+    int group;
+    std::vector<size_t> retained, generated;
+    std::vector< std::map<int,size_t> > profiles;
+    
+    TrackingRunState ()
+        : key(0), group(0) {}
+    
+    void saveState (BinaryOutputStream &stream)
+    {
+        stream.writeValue<uint64_t>(key);
+        stream.writeValue<int32_t>(group);
+        stream.writeValue<uint64_t>(retained.size());
+        for (size_t i=0; i<retained.size(); i++)
+            stream.writeValue<uint64_t>(retained[i]);
+        stream.writeValue<uint64_t>(generated.size());
+        for (size_t i=0; i<generated.size(); i++)
+            stream.writeValue<uint64_t>(generated[i]);
+        stream.writeValue<uint64_t>(profiles.size());
+        for (size_t i=0; i<profiles.size(); i++)
+        {
+            stream.writeValue<uint64_t>(profiles[i].size());
+            for (std::map<int,size_t>::const_iterator it=profiles[i].begin(); it!=profiles[i].end(); it++)
+            {
+                stream.writeValue<int32_t>(it->first);
+                stream.writeValue<uint64_t>(it->second);
+            }
+        }
+    }
+    
+    void restoreState (BinaryInputStream &stream)
+    {
+        key = stream.readValue<uint64_t>();
+        group = stream.readValue<int32_t>();
+        retained.resize(stream.readValue<uint64_t>());
+        for (size_t i=0; i<retained.size(); i++)
+            retained[i] = stream.readValue<uint64_t>();
+        generated.resize(stream.readValue<uint64_t>());
+        for (size_t i=0; i<generated.size(); i++)
+            generated[i] = stream.readValue<uint64_t>();
+        profiles.resize(stream.readValue<uint64_t>());
+        for (size_t i=0; i<profiles.size(); i++)
+        {
+            profiles[i].clear();
+            const size_t n = stream.readValue<uint64_t>();
+            for (size_t j=0; j<n; j++)
+            {
+                const int label = stream.readValue<int32_t>();
+                profiles[i][label] = stream.readValue<uint64_t>();
+            }
+        }
+    }
+};
+
+// The range of (positive) target labels, which sizes the profile matrix;
+// the range is empty if there are no targets
+static void targetRange (const Tracker &tracker, int &minLabel, int &maxLabel)
+{
+    minLabel = 1;
+    maxLabel = 0;
+    const Array<int> *targetData = tracker.getTargetData();
+    if (targetData == NULL)
+        return;
+    
+    bool found = false;
+    for (Array<int>::const_iterator it=targetData->begin(); it!=targetData->end(); it++)
+    {
+        if (*it <= 0)
+            continue;
+        else if (!found)
+        {
+            minLabel = maxLabel = *it;
+            found = true;
+        }
+        else
+        {
+            minLabel = std::min(minLabel, *it);
+            maxLabel = std::max(maxLabel, *it);
+        }
+    }
+}
+
+void TrackingJob::configure (Tracker &tracker) const
+{
+    tracker.setFlags(flags);
+    tracker.setRightwardsVector(rightwardsVector);
+    tracker.setInnerProductThreshold(curvatureThreshold);
+    tracker.setStepLength(stepLength);
+    tracker.setMaxSteps(maxSteps);
+}
+
+void TrackingJob::run (Tracker &tracker, const RNifti::NiftiImage &mask)
+{
+    const Grid<3> &grid = tracker.getModel()->getGrid3D();
+    const int nGroups = this->nGroups();
+    
+    // In seedwise mode each seed gets its own pipeline and outputs, but the
+    // tracker, model and mask are set up only once. Visitation maps are
+    // written to one file per seed, while streamlines and medians are
+    // appended to a single file, in seed order
+    if (!mapPaths.empty() && mapPaths.size() != static_cast<size_t>(nGroups))
+        throw std::invalid_argument("The number of visitation map paths does not match the number of seed groups");
+    if (!connectomePath.empty() && seedwise)
+        throw std::invalid_argument("Connectome output is not available in seedwise mode");
+    if (!connectomePath.empty() && tracker.getTargetData() == NULL)
+        throw std::invalid_argument("Connectome output requires targets, which are used as the parcellation");
+    if (tolerance > 0.0 && measure == TractographyDataSource::ProfileConvergence && tracker.getTargetData() == NULL)
+        throw std::invalid_argument("Convergence of target profiles requires targets");
+    
+    // The counter-based random generator is always used, with its key taken
+    // from R (unless one is given) and mixed with the group index, so that
+    // each seed group gets its own streams and results don't depend on the
+    // number of threads. This also means that a resumed run can regenerate
+    // exactly the streamlines an uninterrupted one would have. On
+    // resumption, the outputs of the interrupted group are truncated to
+    // their checkpointed lengths and the group is continued
+    TrackingRunState state;
+    const bool checkpointing = !checkpointPath.empty();
+    bool resuming = false;
+    if (checkpointing)
+    {
+        if (!medianPath.empty())
+            throw std::invalid_argument("Median streamline output cannot be combined with checkpointing");
+        
+        Checkpoint checkpoint(checkpointPath);
+        resuming = (resume && checkpoint.exists());
+        if (resuming)
+        {
+            // Only the run state is needed at this point
+            checkpoint.add(&state);
+            checkpoint.restore();
+            if (state.group >= nGroups)
+                throw std::runtime_error("Checkpoint does not match the current seeds");
+        }
+    }
+    if (!resuming)
+        state.key = (useKey ? key : RandomGenerator::keyFromR());
+    
+    int minLabel = 1, maxLabel = 0;
+    if (requireProfile)
+        targetRange(tracker, minLabel, maxLabel);
+    
+    const int firstGroup = state.group;
+    for (int g=firstGroup; g<nGroups; g++)
+    {
+        const bool resumeGroup = (resuming && g == firstGroup);
+        const bool append = (g > 0 || resumeGroup);
+        
+        const Eigen::ArrayX3f groupSeeds = (seedwise ? Eigen::ArrayX3f(seeds.row(g)) : seeds);
+        tracker.setRandomGenerator(RandomGenerator(state.key ^ (static_cast<uint64_t>(g) * UINT64_C(0x9e3779b97f4a7c15))));
+        TractographyDataSource dataSource(&tracker, groupSeeds, count, jitter);
+        if (tolerance > 0.0)
+            dataSource.setConvergence(tolerance, minCount, batchSize, measure);
+        dataSource.setThreads(threads);
+        Pipeline<Streamline> pipeline(&dataSource);
+        
+        if (minTargetHits > 0)
+            pipeline.addManipulator(new LabelCountFilter(minTargetHits));
+        if (minLength > 0.0 || maxLength > 0.0)
+            pipeline.addManipulator(new LengthFilter(minLength, maxLength));
+        
+        VisitationMapDataSink *visitationMap = NULL;
+        if (!mapPaths.empty())
+        {
+            visitationMap = new VisitationMapDataSink(mask.dim());
+            visitationMap->setThreads(threads);
+            pipeline.addSink(visitationMap);
+        }
+        if (!trkPath.empty())
+        {
+            TrackvisDataSink *trkFile;
+            if (!labelDictionary.empty())
+                trkFile = new LabelledTrackvisDataSink(trkPath, grid, labelDictionary, append);
+            else
+                trkFile = new BasicTrackvisDataSink(trkPath, grid, append);
+            trkFile->setTolerance(trkTolerance);
+            pipeline.addSink(trkFile);
+        }
+        if (!medianPath.empty())
+            pipeline.addSink(new MedianTrackvisDataSink(medianPath, grid, medianQuantile, g > 0));
+        ConnectomeDataSink *connectome = NULL;
+        if (!connectomePath.empty())
+        {
+            connectome = new ConnectomeDataSink(*tracker.getTargetData(), connectomeEdges);
+            if (!connectomeScalarPath.empty())
+            {
+                RNifti::NiftiImage scalarImage(connectomeScalarPath);
+                scalarImage.reorient(grid3DOrientation(grid));
+                Array<float> *scalars = getImageArray<float>(scalarImage);
+                connectome->setScalars(*scalars);
+                delete scalars;
+            }
+            pipeline.addSink(connectome);
+        }
+        ProfileMatrixDataSink *profile = NULL;
+        if (requireProfile)
+        {
+            profile = new ProfileMatrixDataSink(minLabel, maxLabel, (seedProfiles && !seedwise) ? groupSeeds.rows() : 0);
+            profile->setThreads(threads);
+            pipeline.addSink(profile);
+        }
+        
+        Checkpoint checkpoint(checkpointPath);
+        if (checkpointing)
+        {
+            state.group = g;
+            checkpoint.add(&state);
+            pipeline.setCheckpoint(&checkpoint, checkpointInterval, resumeGroup, checkpointLimit);
+        }
+        
+        state.retained.push_back(pipeline.run());
+        
+        const std::vector<size_t> &seedCounts = dataSource.getSeedCounts();
+        state.generated.insert(state.generated.end(), seedCounts.begin(), seedCounts.end());
+        if (profile != NULL)
+        {
+            for (size_t i=0; i<profile->nRows(); i++)
+                state.profiles.push_back(profile->getCounts(i));
+        }
+        
+        if (visitationMap != NULL)
+            visitationMap->writeToNifti(mask, mapPaths[g]);
+        if (connectome != NULL)
+            connectome->writeEdgeList(connectomePath);
+    }
+    
+    // The run is complete, so the checkpoint is no longer needed
+    if (checkpointing)
+        Checkpoint(checkpointPath).remove();
+    
+    retained = state.retained;
+    generated = state.generated;
+    profiles = state.profiles;
+}
@@ -0,0 +1,80 @@
+#ifndef _TRACKING_JOB_H_
+#define _TRACKING_JOB_H_
+
+#include <RcppEigen.h>
+
+#include "Space.h"
+#include "RNifti.h"
+#include "Tracker.h"
+#include "Connectome.h"
+
+// A complete tracking run: tracker settings, seeds, filters and outputs,
+// independent of where they came from (a direct call from R, or a request to
+// a tracking server). Streamlines, maps, medians and connectomes are written to file, and
+// counts (plus label profiles, if requested) are kept in the job
+class TrackingJob
+{
+public:
+    // Tracker settings
+    std::map<std::string,bool> flags;
+    Space<3>::Vector rightwardsVector;
+    float curvatureThreshold, stepLength;
+    int maxSteps;
+    std::map<int,std::string> labelDictionary;
+    
+    // Seeds (in zero-based voxel coordinates) and streamline counts; in
+    // seedwise mode each seed gets its own pipeline and outputs
+    Eigen::ArrayX3f seeds;
+    size_t count;
+    bool jitter, seedwise;
+    int threads;
+    
+    // Filters
+    int minTargetHits;
+    double minLength, maxLength;
+    
+    // Adaptive streamline counts, if the tolerance is positive
+    double tolerance;
+    size_t minCount, batchSize;
+    TractographyDataSource::ConvergenceMeasure measure;
+    
+    // Outputs: one map path per seed group, if maps are required
+    std::vector<std::string> mapPaths;
+    std::string trkPath, medianPath;
+    double medianQuantile;
+    
+    // Streamlines written to file are simplified to within this tolerance (in mm), if it's positive
+    double trkTolerance;
+    
+    // Label profiles, one per seed group, or one per seed if seedProfiles is set
+    bool requireProfile, seedProfiles;
+    
+    // A connectome edge list, using the targets as the parcellation, with an
+    // optional scalar image whose mean along each edge is also reported
+    std::string connectomePath, connectomeScalarPath;
+    ConnectomeDataSink::EdgeDefinition connectomeEdges;
+    
+    // Checkpointing, and an optional key for the counter-based random generator
+    // A positive checkpoint limit stops each group, as if interrupted, after that many checkpoints (for testing)
+    std::string checkpointPath;
+    size_t checkpointInterval, checkpointLimit;
+    bool resume, useKey;
+    uint64_t key;
+    
+    // Results: counts for each seed group (retained) or seed (generated), and profiles
+    std::vector<size_t> retained, generated;
+    std::vector< std::map<int,size_t> > profiles;
+    
+    TrackingJob ()
+        : rightwardsVector(Space<3>::zeroVector()), curvatureThreshold(0.2), stepLength(0.5), maxSteps(2000), count(0), jitter(true), seedwise(false), threads(1), minTargetHits(0), minLength(0.0), maxLength(0.0), tolerance(0.0), minCount(0), batchSize(0), measure(TractographyDataSource::VisitationConvergence), medianQuantile(0.99), trkTolerance(0.0), requireProfile(false), seedProfiles(false), connectomeEdges(ConnectomeDataSink::EndpointEdges), checkpointInterval(0), checkpointLimit(0), resume(false), useKey(false), key(0) {}
+    
+    int nGroups () const { return (seedwise ? seeds.rows() : 1); }
+    
+    // Apply the tracker settings; the model, mask and targets must already be set
+    void configure (Tracker &tracker) const;
+    
+    // Run the job, using the mask image as a reference for visitation maps
+    void run (Tracker &tracker, const RNifti::NiftiImage &mask);
+};
+
+#endif
@@ -0,0 +1,592 @@
+#include <RcppEigen.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "RNifti.h"
+#include "DiffusionModel.h"
+#include "Tracker.h"
+#include "TrackingJob.h"
+#include "TrackingServer.h"
+
+#ifndef _WIN32
+
+// Read everything until the other end closes (or half-closes) the connection
+static std::string readAll (const int descriptor)
+{
+    std::string text;
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(descriptor, buffer, sizeof(buffer))) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("Failed to read from tracking server socket");
+        }
+        text.append(buffer, n);
+    }
+    return text;
+}
+
+static void writeAll (const int descriptor, const std::string &text)
+{
+    size_t written = 0;
+    while (written < text.size())
+    {
+        const ssize_t n = write(descriptor, text.data() + written, text.size() - written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("Failed to write to tracking server socket");
+        }
+        written += n;
+    }
+}
+
+static sockaddr_un socketAddress (const std::string &socketPath)
+{
+    sockaddr_un address;
+    if (socketPath.size() >= sizeof(address.sun_path))
+        throw std::invalid_argument("Tracking server socket path is too long");
+    
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+#endif
+
+template <typename Type>
+static Type requestValue (const std::map< std::string, std::vector<std::string> > &request, const std::string &key, const Type defaultValue)
+{
+    std::map< std::string, std::vector<std::string> >::const_iterator it = request.find(key);
+    if (it == request.end() || it->second.empty())
+        return defaultValue;
+    
+    Type value;
+    std::istringstream stream(it->second.back());
+    if (!(stream >> value))
+        throw std::invalid_argument("Invalid value for request field \"" + key + "\"");
+    return value;
+}
+
+// Strings (e.g. paths) are taken verbatim, since they may contain spaces
+template <>
+std::string requestValue (const std::map< std::string, std::vector<std::string> > &request, const std::string &key, const std::string defaultValue)
+{
+    std::map< std::string, std::vector<std::string> >::const_iterator it = request.find(key);
+    if (it == request.end() || it->second.empty())
+        return defaultValue;
+    else
+        return it->second.back();
+}
+
+static std::vector<std::string> requestValues (const std::map< std::string, std::vector<std::string> > &request, const std::string &key)
+{
+    std::map< std::string, std::vector<std::string> >::const_iterator it = request.find(key);
+    if (it == request.end())
+        return std::vector<std::string>();
+    else
+        return it->second;
+}
+
+// Summarise the sizes and modification times of the files behind each path,
+// which are usually image file stems, so that rewritten files are noticed
+static std::string fileSignature (const std::vector<std::string> &paths)
+{
+    static const char *suffixes[] = { "", ".nii", ".nii.gz", ".hdr", ".hdr.gz", ".img", ".img.gz" };
+    std::ostringstream signature;
+    struct stat info;
+    for (size_t i=0; i<paths.size(); i++)
+    {
+        for (int j=0; j<7; j++)
+        {
+            if (stat((paths[i] + suffixes[j]).c_str(), &info) != 0)
+                continue;
+            signature << paths[i] << suffixes[j] << " " << info.st_size << " " << info.st_mtime;
+#if defined(__APPLE__)
+            signature << "." << info.st_mtimespec.tv_nsec;
+#elif !defined(_WIN32)
+            signature << "." << info.st_mtim.tv_nsec;
+#endif
+            signature << "\n";
+        }
+    }
+    return signature.str();
+}
+
+template <typename Type>
+static std::string leastRecentlyUsed (const std::map< std::string, CacheEntry<Type> > &cache)
+{
+    typename std::map< std::string, CacheEntry<Type> >::const_iterator oldest = cache.begin();
+    for (typename std::map< std::string, CacheEntry<Type> >::const_iterator it=cache.begin(); it!=cache.end(); it++)
+    {
+        if (it->second.lastUsed < oldest->second.lastUsed)
+            oldest = it;
+    }
+    return oldest->first;
+}
+
+template <typename Type>
+static bool readFrom (const CacheEntry<Type> &entry, const std::vector<std::string> &paths)
+{
+    for (size_t i=0; i<paths.size(); i++)
+    {
+        if (std::find(entry.sources.begin(), entry.sources.end(), paths[i]) != entry.sources.end())
+            return true;
+    }
+    return false;
+}
+
+static std::vector<double> parseNumbers (const std::string &text, const size_t n)
+{
+    std::vector<double> numbers;
+    std::istringstream stream(text);
+    double value;
+    while (stream >> value)
+        numbers.push_back(value);
+    if (numbers.size() != n)
+        throw std::invalid_argument("Wrong number of values in request field \"" + text + "\"");
+    return numbers;
+}
+
+TrackingServer::TrackingServer (const std::string &socketPath, const int nThreads)
+    : socketPath(socketPath), nThreads(std::max(nThreads,1)), socketDescriptor(-1), useCounter(0)
+{
+#ifdef _WIN32
+    throw std::runtime_error("The tracking server is not supported on Windows");
+#else
+    const sockaddr_un address = socketAddress(socketPath);
+    
+    socketDescriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketDescriptor < 0)
+        throw std::runtime_error("Failed to create tracking server socket");
+    
+    // A stale socket file may be left over from a server that didn't shut down cleanly
+    unlink(socketPath.c_str());
+    if (bind(socketDescriptor, (const sockaddr *) &address, sizeof(address)) != 0 || listen(socketDescriptor, 16) != 0)
+    {
+        close(socketDescriptor);
+        throw std::runtime_error("Failed to listen on socket " + socketPath);
+    }
+#endif
+}
+
+TrackingServer::~TrackingServer ()
+{
+#ifndef _WIN32
+    if (socketDescriptor >= 0)
+    {
+        close(socketDescriptor);
+        unlink(socketPath.c_str());
+    }
+#endif
+    clear();
+}
+
+void TrackingServer::dropModel (const std::string &key)
+{
+    // Trackers refer to their model, so they have to go too
+    std::map< std::string, CacheEntry<Tracker*> >::iterator it = trackers.lower_bound(key + "\n");
+    while (it != trackers.end() && it->first.compare(0, key.size()+1, key + "\n") == 0)
+    {
+        delete it->second.value;
+        trackers.erase(it++);
+    }
+    
+    delete models[key].value;
+    models.erase(key);
+}
+
+void TrackingServer::dropTracker (const std::string &key)
+{
+    delete trackers[key].value;
+    trackers.erase(key);
+}
+
+void TrackingServer::release (const Request &request)
+{
+    const std::vector<std::string> paths = requestValues(request, "transient");
+    if (paths.empty())
+        return;
+    
+    std::vector<std::string> keys;
+    for (std::map< std::string, CacheEntry<Tracker*> >::const_iterator it=trackers.begin(); it!=trackers.end(); it++)
+    {
+        if (readFrom(it->second, paths))
+            keys.push_back(it->first);
+    }
+    for (size_t i=0; i<keys.size(); i++)
+        dropTracker(keys[i]);
+    
+    keys.clear();
+    for (std::map< std::string, CacheEntry<DiffusionModel*> >::const_iterator it=models.begin(); it!=models.end(); it++)
+    {
+        if (readFrom(it->second, paths))
+            keys.push_back(it->first);
+    }
+    for (size_t i=0; i<keys.size(); i++)
+        dropModel(keys[i]);
+    
+    for (std::map< std::string, CacheEntry<RNifti::NiftiImage> >::iterator it=images.begin(); it!=images.end(); )
+    {
+        if (readFrom(it->second, paths))
+            images.erase(it++);
+        else
+            it++;
+    }
+}
+
+void TrackingServer::clear ()
+{
+    for (std::map< std::string, CacheEntry<Tracker*> >::iterator it=trackers.begin(); it!=trackers.end(); it++)
+        delete it->second.value;
+    for (std::map< std::string, CacheEntry<DiffusionModel*> >::iterator it=models.begin(); it!=models.end(); it++)
+        delete it->second.value;
+    
+    trackers.clear();
+    models.clear();
+    images.clear();
+}
+
+TrackingServer::Request TrackingServer::parseRequest (const std::string &text)
+{
+    Request request;
+    std::istringstream stream(text);
+    std::string line;
+    while (std::getline(stream, line))
+    {
+        if (line.empty() || line == "end")
+            continue;
+        
+        // The key is the first word; the value is the rest of the line, which may contain spaces
+        const size_t space = line.find(' ');
+        if (space == std::string::npos)
+            request[line].push_back("");
+        else
+            request[line.substr(0,space)].push_back(line.substr(space+1));
+    }
+    return request;
+}
+
+DiffusionModel * TrackingServer::getModel (const Request &request, std::string &key)
+{
+    const std::string type = requestValue<std::string>(request, "model", "");
+    const std::vector<std::string> directions = requestValues(request, "directions");
+    const std::vector<std::string> avf = requestValues(request, "avf");
+    const std::vector<std::string> theta = requestValues(request, "theta");
+    const std::vector<std::string> phi = requestValues(request, "phi");
+    
+    // The key identifies the model by its source files
+    key = type;
+    std::vector<std::string> sources;
+    const std::vector<std::string> *paths[4] = { &directions, &avf, &theta, &phi };
+    for (int i=0; i<4; i++)
+    {
+        for (size_t j=0; j<paths[i]->size(); j++)
+        {
+            key += "\n" + (*paths[i])[j];
+            sources.push_back((*paths[i])[j]);
+        }
+    }
+    
+    const std::string signature = fileSignature(sources);
+    if (models.count(key) == 1 && models[key].signature != signature)
+        dropModel(key);
+    
+    if (models.count(key) == 0)
+    {
+        DiffusionModel *model;
+        if (type == "dti" && directions.size() == 1)
+            model = new DiffusionTensorModel(directions[0]);
+        else if (type == "bedpost" && !avf.empty())
+            model = new BedpostModel(avf, theta, phi);
+        else
+            throw std::invalid_argument("Diffusion model is missing or incompletely specified");
+        
+        while (models.size() >= maxModels)
+            dropModel(leastRecentlyUsed(models));
+        models[key].value = model;
+        models[key].sources = sources;
+        models[key].signature = signature;
+    }
+    
+    DiffusionModel *model = models[key].value;
+    models[key].lastUsed = ++useCounter;
+    
+    // The threshold can differ between jobs without reloading the model
+    BedpostModel *bedpostModel = dynamic_cast<BedpostModel*>(model);
+    if (bedpostModel != NULL)
+        bedpostModel->setAvfThreshold(requestValue<float>(request, "avfThreshold", 0.05));
+    
+    return model;
+}
+
+const RNifti::NiftiImage & TrackingServer::getImage (const std::string &path, const std::string &orientation)
+{
+    const std::string key = path + "\n" + orientation;
+    const std::vector<std::string> sources(1, path);
+    const std::string signature = fileSignature(sources);
+    if (images.count(key) == 1 && images[key].signature != signature)
+        images.erase(key);
+    
+    if (images.count(key) == 0)
+    {
+        RNifti::NiftiImage image(path);
+        image.reorient(orientation);
+        
+        while (images.size() >= maxImages)
+            images.erase(leastRecentlyUsed(images));
+        images[key].value = image;
+        images[key].sources = sources;
+        images[key].signature = signature;
+    }
+    
+    images[key].lastUsed = ++useCounter;
+    return images[key].value;
+}
+
+Tracker * TrackingServer::getTracker (const Request &request, RNifti::NiftiImage &mask)
+{
+    std::string modelKey;
+    DiffusionModel *model = getModel(request, modelKey);
+    const std::string orientation = grid3DOrientation(model->getGrid3D());
+    
+    const std::string maskPath = requestValue<std::string>(request, "mask", "");
+    const std::string targetsPath = requestValue<std::string>(request, "targets", "");
+    if (maskPath.empty())
+        throw std::invalid_argument("No tracking mask has been specified");
+    mask = getImage(maskPath, orientation);
+    
+    // Each combination of model, mask and targets has its own tracker; jobs use copies that share its data
+    // The model's files have already been checked, so only the mask and targets matter here
+    const std::string key = modelKey + "\n" + maskPath + "\n" + targetsPath;
+    std::vector<std::string> sources(1, maskPath);
+    if (!targetsPath.empty())
+        sources.push_back(targetsPath);
+    const std::string signature = fileSignature(sources);
+    if (trackers.count(key) == 1 && trackers[key].signature != signature)
+        dropTracker(key);
+    
+    if (trackers.count(key) == 0)
+    {
+        Tracker *tracker = new Tracker(model);
+        tracker->setMask(mask);
+        if (!targetsPath.empty())
+            tracker->setTargets(getImage(targetsPath, orientation));
+        
+        while (trackers.size() >= maxTrackers)
+            dropTracker(leastRecentlyUsed(trackers));
+        trackers[key].value = tracker;
+        trackers[key].sources = sources;
+        trackers[key].signature = signature;
+    }
+    
+    trackers[key].lastUsed = ++useCounter;
+    return trackers[key].value;
+}
+
+std::string TrackingServer::runJob (const Request &request)
+{
+    RNifti::NiftiImage mask;
+    Tracker tracker(*getTracker(request, mask));
+    TrackingJob job;
+    
+    job.flags["loopcheck"] = requestValue<int>(request, "loopcheck", 1);
+    job.flags["one-way"] = requestValue<int>(request, "oneWay", 0);
+    job.flags["terminate-targets"] = requestValue<int>(request, "terminateAtTargets", 0);
+    if (request.count("rightwards") == 1)
+    {
+        const std::vector<double> vector = parseNumbers(requestValue<std::string>(request, "rightwards", ""), 3);
+        for (int i=0; i<3; i++)
+            job.rightwardsVector[i] = vector[i];
+    }
+    job.curvatureThreshold = requestValue<float>(request, "curvatureThreshold", job.curvatureThreshold);
+    job.stepLength = requestValue<float>(request, "stepLength", job.stepLength);
+    job.maxSteps = requestValue<int>(request, "maxSteps", job.maxSteps);
+    job.configure(tracker);
+    
+    const std::vector<std::string> labels = requestValues(request, "label");
+    for (size_t i=0; i<labels.size(); i++)
+    {
+        const size_t space = labels[i].find(' ');
+        job.labelDictionary[atoi(labels[i].c_str())] = (space == std::string::npos ? "" : labels[i].substr(space+1));
+    }
+    
+    // Seeds are given in R's one-based voxel convention
+    const std::vector<std::string> seeds = requestValues(request, "seed");
+    job.seeds.resize(seeds.size(), 3);
+    for (size_t i=0; i<seeds.size(); i++)
+    {
+        const std::vector<double> seed = parseNumbers(seeds[i], 3);
+        for (int j=0; j<3; j++)
+            job.seeds(i,j) = static_cast<float>(seed[j] - 1.0);
+    }
+    
+    job.count = requestValue<size_t>(request, "count", 0);
+    job.jitter = requestValue<int>(request, "jitter", 1);
+    job.seedwise = requestValue<int>(request, "seedwise", 0);
+    job.threads = nThreads;
+    job.minTargetHits = requestValue<int>(request, "minTargetHits", 0);
+    job.minLength = requestValue<double>(request, "minLength", 0.0);
+    job.maxLength = requestValue<double>(request, "maxLength", 0.0);
+    
+    job.tolerance = requestValue<double>(request, "tolerance", 0.0);
+    job.minCount = requestValue<size_t>(request, "minCount", 0);
+    job.batchSize = requestValue<size_t>(request, "batchSize", 0);
+    if (requestValue<std::string>(request, "measure", "map") == "profile")
+        job.measure = TractographyDataSource::ProfileConvergence;
+    
+    job.mapPaths = requestValues(request, "map");
+    job.trkPath = requestValue<std::string>(request, "streamlines", "");
+    job.trkTolerance = requestValue<double>(request, "streamlineTolerance", 0.0);
+    job.medianPath = requestValue<std::string>(request, "median", "");
+    job.medianQuantile = requestValue<double>(request, "medianQuantile", 0.99);
+    job.connectomePath = requestValue<std::string>(request, "connectome", "");
+    job.connectomeScalarPath = requestValue<std::string>(request, "connectomeScalars", "");
+    if (requestValue<std::string>(request, "connectomeEdges", "endpoints") == "traversal")
+        job.connectomeEdges = ConnectomeDataSink::TraversalEdges;
+    
+    // A profile value of 2 requests one profile per seed, rather than per seed group
+    const int profile = requestValue<int>(request, "profile", 0);
+    job.requireProfile = (profile > 0);
+    job.seedProfiles = (profile == 2);
+    
+    job.checkpointPath = requestValue<std::string>(request, "checkpoint", "");
+    job.checkpointInterval = requestValue<size_t>(request, "checkpointInterval", 0);
+    job.resume = requestValue<int>(request, "resume", 0);
+    
+    // The client supplies a key for the random generator, drawn from its own R session, so that its seed applies
+    // The server never draws from R's generator itself
+    if (request.count("key") != 1)
+        throw std::invalid_argument("Request does not specify a random generator key");
+    const std::vector<double> halves = parseNumbers(requestValue<std::string>(request, "key", ""), 2);
+    job.useKey = true;
+    job.key = (static_cast<uint64_t>(halves[0]) << 32) | static_cast<uint64_t>(halves[1]);
+    
+    job.run(tracker, mask);
+    
+    std::ostringstream response;
+    response << "retained";
+    for (size_t i=0; i<job.retained.size(); i++)
+        response << " " << job.retained[i];
+    response << "\ngenerated";
+    for (size_t i=0; i<job.generated.size(); i++)
+        response << " " << job.generated[i];
+    response << "\n";
+    for (size_t i=0; i<job.profiles.size(); i++)
+    {
+        response << "profile";
+        for (std::map<int,size_t>::const_iterator it=job.profiles[i].begin(); it!=job.profiles[i].end(); it++)
+            response << " " << it->first << " " << it->second;
+        response << "\n";
+    }
+    return response.str();
+}
+
+void TrackingServer::run ()
+{
+#ifndef _WIN32
+    bool finished = false;
+    while (!finished)
+    {
+        // Wake up regularly so that the server can be interrupted from R
+        pollfd pollInfo;
+        pollInfo.fd = socketDescriptor;
+        pollInfo.events = POLLIN;
+        if (poll(&pollInfo, 1, 500) <= 0)
+        {
+            Rcpp::checkUserInterrupt();
+            continue;
+        }
+        
+        const int connection = accept(socketDescriptor, NULL, NULL);
+        if (connection < 0)
+            continue;
+        
+        std::string response;
+        try
+        {
+            const Request request = parseRequest(readAll(connection));
+            if (request.count("shutdown") == 1)
+            {
+                finished = true;
+                response = "ok\n";
+            }
+            else if (request.count("clear") == 1)
+            {
+                clear();
+                response = "ok\n";
+            }
+            else
+            {
+                // Release transient files whether or not the job succeeds
+                try { response = runJob(request); }
+                catch (...)
+                {
+                    release(request);
+                    throw;
+                }
+                release(request);
+            }
+        }
+        catch (std::exception &e)
+        {
+            response = std::string("error ") + e.what() + "\n";
+        }
+        
+        // A client that has gone away shouldn't bring the server down
+        try { writeAll(connection, response); }
+        catch (std::exception &e) {}
+        close(connection);
+    }
+#endif
+}
+
+std::string sendTrackingRequest (const std::string &socketPath, const std::string &request)
+{
+#ifdef _WIN32
+    throw std::runtime_error("The tracking server is not supported on Windows");
+#else
+    const sockaddr_un address = socketAddress(socketPath);
+    
+    const int descriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (descriptor < 0)
+        throw std::runtime_error("Failed to create socket");
+    if (connect(descriptor, (const sockaddr *) &address, sizeof(address)) != 0)
+    {
+        close(descriptor);
+        throw std::runtime_error("Failed to connect to tracking server at " + socketPath);
+    }
+    
+    std::string response;
+    try
+    {
+        // Half-close the connection to mark the end of the request
+        writeAll(descriptor, request);
+        shutdown(descriptor, SHUT_WR);
+        response = readAll(descriptor);
+    }
+    catch (...)
+    {
+        close(descriptor);
+        throw;
+    }
+    
+    close(descriptor);
+    return response;
+#endif
+}
@@ -0,0 +1,69 @@
+#ifndef _TRACKING_SERVER_H_
+#define _TRACKING_SERVER_H_
+
+#include <RcppEigen.h>
+
+#include "RNifti.h"
+#include "DiffusionModel.h"
+#include "Tracker.h"
+#include "TrackingJob.h"
+
+// A cached object, with the files it was read from and their state at the time
+template <typename Type>
+struct CacheEntry
+{
+    Type value;
+    std::vector<std::string> sources;
+    std::string signature;
+    unsigned long lastUsed;
+};
+
+// A long-lived tracking service: diffusion models, masks and targets are
+// loaded on first use and kept in memory, and jobs are received over a local
+// (Unix domain) socket. Jobs are run one at a time, and each one is tracked
+// with the server's thread count, as track() would. A request is a series of
+// "key value" lines, and the response is either the job's counts or a line
+// starting "error". Objects read from files that the request marks as
+// "transient" (e.g. temporary masks) are dropped once the job is finished
+class TrackingServer
+{
+private:
+    typedef std::map< std::string, std::vector<std::string> > Request;
+    
+    std::string socketPath;
+    int nThreads;
+    int socketDescriptor;
+    
+    // Cached objects are reloaded if their files change, and the least recently used are dropped beyond these limits
+    static const size_t maxModels = 4;
+    static const size_t maxImages = 16;
+    static const size_t maxTrackers = 16;
+    
+    std::map< std::string, CacheEntry<DiffusionModel*> > models;
+    std::map< std::string, CacheEntry<RNifti::NiftiImage> > images;
+    std::map< std::string, CacheEntry<Tracker*> > trackers;
+    unsigned long useCounter;
+    
+    static Request parseRequest (const std::string &text);
+    DiffusionModel * getModel (const Request &request, std::string &key);
+    const RNifti::NiftiImage & getImage (const std::string &path, const std::string &orientation);
+    Tracker * getTracker (const Request &request, RNifti::NiftiImage &mask);
+    void dropModel (const std::string &key);
+    void dropTracker (const std::string &key);
+    void release (const Request &request);
+    void clear ();
+    
+    std::string runJob (const Request &request);
+    
+public:
+    TrackingServer (const std::string &socketPath, const int nThreads = 1);
+    ~TrackingServer ();
+    
+    // Serve requests until one asks the server to shut down
+    void run ();
+};
+
+// Send a request to a tracking server, and return its response
+std::string sendTrackingRequest (const std::string &socketPath, const std::string &request);
+
+#endif
@@ -37,63 +37,512 @@ std::map<int,char> TrackvisDataSink::orientationCodeMap = TrackvisDataSink::crea
 // 
 // Source: Trackvis documentation (http://www.trackvis.org/docs/?subsect=fileformat)
 
+// Select the nth smallest element in place, so the vector is partially reordered
 template <typename ElementType>
-ElementType getNthElement (std::vector<ElementType> vec, size_t n)
+ElementType getNthElement (std::vector<ElementType> &vec, size_t n)
 {
     std::nth_element(vec.begin(), vec.begin()+n, vec.end());
     return *(vec.begin()+n);
 }
 
+// Index of the median, or upper median, of n values
+static size_t medianIndex (const size_t n)
+{
+    return std::min(static_cast<size_t>(round(n/2.0)), n-1);
+}
+
 void TrackvisDataSource::readStreamline (Streamline &data)
 {
     int32_t nPoints = binaryStream.readValue<int32_t>();
     if (nPoints > 0)
     {
-        vector<Space<3>::Point> points;
-        int seed = 0;
+        // Pull in the points, scalars and properties as a single block
+        const size_t stride = 3 + nScalars;
+        pointBuffer.resize(nPoints * stride + nProperties);
+        binaryStream.readArray<float>(&pointBuffer[0], pointBuffer.size());
+        
+        vector<Space<3>::Point> points(nPoints);
+        const Eigen::Array3f voxelDims = grid.spacings();
         for (int32_t i=0; i<nPoints; i++)
         {
-            Space<3>::Point point;
-            binaryStream.readVector<float>(point, 3);
             // TrackVis indexes from the left edge of each voxel
-            points.push_back(point / grid.spacings() - 0.5);
-        
-            if (nScalars > 0)
-                fileStream.seekg(4 * nScalars, ios::cur);
+            const float *point = &pointBuffer[i * stride];
+            for (int j=0; j<3; j++)
+                points[i][j] = point[j] / voxelDims[j] - 0.5;
         }
         
+        int seed = 0;
         if (seedProperty >= 0)
-        {
-            fileStream.seekg(4 * seedProperty, ios::cur);
-            seed = static_cast<int>(binaryStream.readValue<float>());
-        }
-        if (nProperties > 0)
-            fileStream.seekg(4 * (nProperties-seedProperty-1), ios::cur);
+            seed = static_cast<int>(pointBuffer[nPoints * stride + seedProperty]);
         
         data = Streamline(vector<Space<3>::Point>(points.rend()-seed-1, points.rend()),
                           vector<Space<3>::Point>(points.begin()+seed, points.end()),
                           Streamline::VoxelPointType,
                           grid.spacings(),
                           false);
+        
+        if (nScalars > 0)
+        {
+            vector<float> leftScalars, rightScalars;
+            for (int32_t i=seed; i>=0; i--)
+                leftScalars.insert(leftScalars.end(), &pointBuffer[i*stride + 3], &pointBuffer[(i+1)*stride]);
+            for (int32_t i=seed; i<nPoints; i++)
+                rightScalars.insert(rightScalars.end(), &pointBuffer[i*stride + 3], &pointBuffer[(i+1)*stride]);
+            data.setScalars(nScalars, leftScalars, rightScalars);
+        }
+        
+        if (!streamlineProperties.empty())
+        {
+            vector<float> properties(streamlineProperties.size());
+            for (size_t i=0; i<streamlineProperties.size(); i++)
+                properties[i] = pointBuffer[nPoints * stride + streamlineProperties[i]];
+            data.setProperties(properties);
+        }
     }
     else
     {
+        // Empty records still replace whatever was read last, and keep the
+        // file's fields so that they can be written out again unchanged
+        data = Streamline(vector<Space<3>::Point>(), vector<Space<3>::Point>(), Streamline::VoxelPointType, grid.spacings(), false);
+        if (nScalars > 0)
+            data.setScalars(nScalars, vector<float>(), vector<float>());
         if (nProperties > 0)
-            fileStream.seekg(4 * nProperties, ios::cur);
+        {
+            pointBuffer.resize(nProperties);
+            binaryStream.readArray<float>(&pointBuffer[0], pointBuffer.size());
+            if (!streamlineProperties.empty())
+            {
+                vector<float> properties(streamlineProperties.size());
+                for (size_t i=0; i<streamlineProperties.size(); i++)
+                    properties[i] = pointBuffer[streamlineProperties[i]];
+                data.setProperties(properties);
+            }
+        }
+    }
+    
+    currentStreamline++;
+}
+
+int32_t MappedTrackvisDataSource::readInt (const size_t position) const
+{
+    if (position + 4 > file.size())
+        throw runtime_error("Trackvis file is truncated");
+    
+    uint32_t value;
+    memcpy(&value, file.begin() + position, 4);
+    if (binaryStream.swappingEndianness())
+        swapBytes32(&value, 1);
+    return static_cast<int32_t>(value);
+}
+
+float MappedTrackvisDataSource::readFloat (const size_t position) const
+{
+    const int32_t bits = readInt(position);
+    float value;
+    memcpy(&value, &bits, 4);
+    return value;
+}
+
+double StreamlinePointView::getLength () const
+{
+    if (nPoints < 2)
+        return 0.0;
+    if (seed < 0 || static_cast<size_t>(seed) >= nPoints)
+        throw runtime_error("Streamline seed index is out of range");
+    
+    // Points are converted to voxels and back just as they would be by a decoded streamline
+    double leftLength = 0.0, rightLength = 0.0;
+    Space<3>::Point previous = (*this)[seed];
+    for (int i=seed-1; i>=0; i--)
+    {
+        const Space<3>::Point current = (*this)[i];
+        leftLength += ((current - previous) * voxelDims).matrix().norm();
+        previous = current;
+    }
+    previous = (*this)[seed];
+    for (size_t i=seed+1; i<nPoints; i++)
+    {
+        const Space<3>::Point current = (*this)[i];
+        rightLength += ((current - previous) * voxelDims).matrix().norm();
+        previous = current;
+    }
+    return leftLength + rightLength;
+}
+
+size_t MappedTrackvisDataSource::locate (const size_t position, StreamlinePointView &view, std::vector<float> &buffer) const
+{
+    const int32_t nPoints = readInt(position);
+    const int stride = 3 + nScalars;
+    const size_t pointsOffset = position + 4;
+    const size_t nFloats = static_cast<size_t>(std::max(nPoints,0)) * stride;
+    
+    const size_t nextOffset = pointsOffset + 4 * (nFloats + nProperties);
+    if (nextOffset > file.size())
+        throw runtime_error("Trackvis file is truncated");
+    
+    int seed = 0;
+    if (nPoints > 0 && seedProperty >= 0)
+        seed = static_cast<int>(readFloat(pointsOffset + 4 * (nFloats + seedProperty)));
+    
+    // Points and properties are used in place unless they need
+    // byte-swapping, when the whole block is converted at once
+    const float *points = reinterpret_cast<const float *>(file.begin() + pointsOffset);
+    if (binaryStream.swappingEndianness() && nFloats + nProperties > 0)
+    {
+        buffer.resize(nFloats + nProperties);
+        memcpy(&buffer[0], points, 4 * (nFloats + nProperties));
+        swapBytes32(reinterpret_cast<uint32_t *>(&buffer[0]), nFloats + nProperties);
+        points = &buffer[0];
+    }
+    
+    view = StreamlinePointView(points, std::max(nPoints,0), stride, seed, grid.spacings(), points + nFloats);
+    return nextOffset;
+}
+
+void MappedTrackvisDataSource::decode (const StreamlinePointView &view, Streamline &data) const
+{
+    // Empty records still replace whatever was decoded last
+    if (view.empty())
+    {
+        data = Streamline(vector<Space<3>::Point>(), vector<Space<3>::Point>(), Streamline::VoxelPointType, grid.spacings(), false);
+        if (nScalars > 0)
+            data.setScalars(nScalars, vector<float>(), vector<float>());
     }
+    else
+    {
+        const int seed = view.getSeedIndex();
+        if (seed < 0 || static_cast<size_t>(seed) >= view.size())
+            throw runtime_error("Streamline seed index is out of range");
+        
+        vector<Space<3>::Point> leftPoints(seed+1), rightPoints(view.size()-seed);
+        for (int i=seed; i>=0; i--)
+            leftPoints[seed-i] = view[i];
+        for (size_t i=seed; i<view.size(); i++)
+            rightPoints[i-seed] = view[i];
+        
+        data = Streamline(leftPoints, rightPoints, Streamline::VoxelPointType, grid.spacings(), false);
+        
+        if (nScalars > 0)
+        {
+            const float *raw = view.raw();
+            const int stride = view.getStride();
+            vector<float> leftScalars, rightScalars;
+            for (int i=seed; i>=0; i--)
+                leftScalars.insert(leftScalars.end(), raw + i*stride + 3, raw + (i+1)*stride);
+            for (size_t i=seed; i<view.size(); i++)
+                rightScalars.insert(rightScalars.end(), raw + i*stride + 3, raw + (i+1)*stride);
+            data.setScalars(nScalars, leftScalars, rightScalars);
+        }
+    }
+    
+    if (!streamlineProperties.empty())
+    {
+        vector<float> properties(streamlineProperties.size());
+        for (size_t i=0; i<streamlineProperties.size(); i++)
+            properties[i] = view.getProperties()[streamlineProperties[i]];
+        data.setProperties(properties);
+    }
+}
+
+void MappedTrackvisDataSource::decodeElements (std::list<Streamline> &block, const std::vector<size_t> &indices)
+{
+    const StreamlineOffsetIndex &index = getOffsetIndex();
+    
+    // Decode straight into list elements, which are then spliced onto the block in order
+    std::list<Streamline> decoded(indices.size());
+    std::vector<Streamline*> elements;
+    for (std::list<Streamline>::iterator it=decoded.begin(); it!=decoded.end(); it++)
+        elements.push_back(&(*it));
+    std::string errorMessage;
+    
+    #pragma omp parallel num_threads(nThreads)
+    {
+        StreamlinePointView view;
+        std::vector<float> buffer;
+        
+        #pragma omp for schedule(dynamic,64)
+        for (long j=0; j<static_cast<long>(indices.size()); j++)
+        {
+            // Exceptions can't propagate out of the parallel region
+            try
+            {
+                if (indices[j] >= totalStreamlines)
+                    throw runtime_error("Streamline index is out of range");
+                locate(index.getOffset(indices[j]), view, buffer);
+                decode(view, *elements[j]);
+            }
+            catch (std::exception &e)
+            {
+                #pragma omp critical
+                errorMessage = e.what();
+            }
+        }
+    }
+    
+    if (!errorMessage.empty())
+        throw runtime_error(errorMessage);
+    
+    block.splice(block.end(), decoded);
+    if (!indices.empty())
+        seek(indices.back() + 1);
+}
+
+void MappedTrackvisDataSource::getView (StreamlinePointView &view)
+{
+    offset = locate(offset, view, swapBuffer);
+    currentStreamline++;
+}
+
+std::vector<double> MappedTrackvisDataSource::getLengths (const std::vector<size_t> &indices)
+{
+    const bool all = indices.empty();
+    const size_t n = (all ? totalStreamlines : indices.size());
+    std::vector<double> lengths(n);
+    
+    // A complete serial pass doesn't need the offset index
+    if (all && nThreads < 2)
+    {
+        StreamlinePointView view;
+        offset = 1000;
+        currentStreamline = 0;
+        for (size_t j=0; j<n; j++)
+        {
+            getView(view);
+            lengths[j] = view.getLength();
+        }
+        return lengths;
+    }
+    
+    const StreamlineOffsetIndex &index = getOffsetIndex();
+    std::string errorMessage;
+    
+    #pragma omp parallel num_threads(nThreads)
+    {
+        StreamlinePointView view;
+        std::vector<float> buffer;
+        
+        #pragma omp for schedule(dynamic,256)
+        for (long j=0; j<static_cast<long>(n); j++)
+        {
+            // Exceptions can't propagate out of the parallel region
+            try
+            {
+                const size_t k = (all ? j : indices[j]);
+                if (k >= totalStreamlines)
+                    throw runtime_error("Streamline index is out of range");
+                locate(index.getOffset(k), view, buffer);
+                lengths[j] = view.getLength();
+            }
+            catch (std::exception &e)
+            {
+                #pragma omp critical
+                errorMessage = e.what();
+            }
+        }
+    }
+    
+    if (!errorMessage.empty())
+        throw runtime_error(errorMessage);
+    
+    return lengths;
+}
+
+void MappedTrackvisDataSource::get (Streamline &data)
+{
+    StreamlinePointView view;
+    getView(view);
+    decode(view, data);
+}
+
+size_t MappedTrackvisDataSource::getBlock (std::list<Streamline> &block, const size_t n)
+{
+    if (nThreads < 2)
+        return TrackvisDataSource::getBlock(block, n);
+    
+    std::vector<size_t> indices;
+    for (size_t i=currentStreamline; i<totalStreamlines && indices.size()<n; i++)
+        indices.push_back(i);
+    decodeElements(block, indices);
+    return indices.size();
+}
+
+size_t MappedTrackvisDataSource::getElements (std::list<Streamline> &block, const std::vector<size_t> &indices)
+{
+    if (nThreads < 2)
+        return TrackvisDataSource::getElements(block, indices);
     
+    decodeElements(block, indices);
+    return indices.size();
+}
+
+void MappedTrackvisDataSource::skip ()
+{
+    const int32_t nPoints = readInt(offset);
+    offset += 4 * (1 + static_cast<size_t>(std::max(nPoints,0)) * (3+nScalars) + nProperties);
     currentStreamline++;
 }
 
+void MappedTrackvisDataSource::seek (const int n)
+{
+    offset = getOffsetIndex().getOffset(n);
+    currentStreamline = n;
+}
+
+// FNV-1a hash of the header and the first and last streamline records. The
+// header includes the streamline count, so with the file size this catches a
+// file that has been rewritten since the index was made
+static uint64_t hashIndexedFile (std::ifstream &trkStream, const std::vector<uint64_t> &offsets, const uint64_t fileSize)
+{
+    std::vector< std::pair<uint64_t,uint64_t> > ranges;
+    ranges.push_back(std::make_pair(UINT64_C(0), offsets.size() > 1 ? offsets[1] : fileSize));
+    if (offsets.size() > 1)
+        ranges.push_back(std::make_pair(offsets.back(), fileSize));
+    
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    std::vector<char> buffer;
+    for (size_t i=0; i<ranges.size(); i++)
+    {
+        if (ranges[i].second < ranges[i].first || ranges[i].second > fileSize)
+            return 0;
+        buffer.resize(ranges[i].second - ranges[i].first);
+        trkStream.seekg(ranges[i].first);
+        trkStream.read(buffer.data(), buffer.size());
+        if (!trkStream.good())
+            return 0;
+        for (size_t j=0; j<buffer.size(); j++)
+            hash = (hash ^ static_cast<unsigned char>(buffer[j])) * UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+bool StreamlineOffsetIndex::read (const std::string &fileStem)
+{
+    clear();
+    
+    std::ifstream trkStream((fileStem + ".trk").c_str(), ios::binary | ios::ate);
+    std::ifstream indexStream((fileStem + ".trki").c_str(), ios::binary);
+    if (!trkStream.is_open() || !indexStream.is_open())
+        return false;
+    
+    BinaryInputStream binaryStream(&indexStream);
+    if (binaryStream.readString(8).compare("TRKINDEX") != 0)
+        return false;
+    
+    // Version 1 indices have no checksum, so are rebuilt
+    const int32_t version = binaryStream.readValue<int32_t>();
+    const bool swapEndian = (version > 0xffff);
+    binaryStream.swapEndianness(swapEndian);
+    if (version != (swapEndian ? 0x02000000 : 2))
+        return false;
+    indexStream.seekg(16);
+    
+    // A file that has changed size since the index was written can't be trusted
+    const uint64_t indexedSize = binaryStream.readValue<uint64_t>();
+    if (indexedSize != static_cast<uint64_t>(trkStream.tellg()))
+        return false;
+    
+    const uint64_t checksum = binaryStream.readValue<uint64_t>();
+    const uint64_t count = binaryStream.readValue<uint64_t>();
+    binaryStream.readVector<uint64_t>(offsets, count);
+    if (!indexStream.good() || hashIndexedFile(trkStream, offsets, indexedSize) != checksum)
+    {
+        clear();
+        return false;
+    }
+    
+    fileSize = indexedSize;
+    return true;
+}
+
+void StreamlineOffsetIndex::write (const std::string &fileStem) const
+{
+    // The Trackvis file must be complete on disk, since the checksum is calculated from it
+    std::ifstream trkStream((fileStem + ".trk").c_str(), ios::binary);
+    const uint64_t checksum = hashIndexedFile(trkStream, offsets, fileSize);
+    if (checksum == 0)
+        throw runtime_error("Failed to read Trackvis file to be indexed");
+    
+    std::ofstream indexStream((fileStem + ".trki").c_str(), ios::binary | ios::trunc);
+    if (!indexStream.is_open())
+        throw runtime_error("Failed to open streamline index file for writing");
+    
+    BinaryOutputStream binaryStream(&indexStream);
+    binaryStream.writeString("TRKINDEX");
+    
+    // File version number, and 4 bytes' padding
+    binaryStream.writeValue<int32_t>(2);
+    binaryStream.writeValue<int32_t>(0);
+    
+    binaryStream.writeValue<uint64_t>(fileSize);
+    binaryStream.writeValue<uint64_t>(checksum);
+    binaryStream.writeValue<uint64_t>(offsets.size());
+    binaryStream.writeVector<uint64_t>(offsets);
+    
+    if (indexStream.fail())
+        throw runtime_error("Failed to write streamline index file");
+}
+
+void StreamlineOffsetIndex::scan (const MemoryMappedFile &file, const int nScalars, const int nProperties, const bool swapEndian)
+{
+    clear();
+    
+    uint64_t offset = 1000;
+    while (offset + 4 <= file.size())
+    {
+        offsets.push_back(offset);
+        
+        uint32_t value;
+        memcpy(&value, file.begin() + offset, 4);
+        if (swapEndian)
+            swapBytes32(&value, 1);
+        const int32_t nPoints = static_cast<int32_t>(value);
+        offset += 4 * (1 + static_cast<uint64_t>(std::max(nPoints,0)) * (3+nScalars) + nProperties);
+    }
+    
+    if (offset != file.size())
+        throw runtime_error("Trackvis file is truncated");
+    fileSize = file.size();
+}
+
+const StreamlineOffsetIndex & TrackvisDataSource::getOffsetIndex ()
+{
+    if (!indexLoaded)
+    {
+        if (!offsetIndex.read(fileStem))
+        {
+            MemoryMappedFile file(fileStem + ".trk");
+            offsetIndex.scan(file, nScalars, nProperties, binaryStream.swappingEndianness());
+            
+            // Not being able to store the index (e.g. in a read-only directory) only costs a rescan next time
+            try {
+                offsetIndex.write(fileStem);
+            }
+            catch (std::exception &e) {
+                Rf_warning("Streamline index could not be saved, so the file will be scanned again next time: %s", e.what());
+            }
+        }
+        indexLoaded = true;
+    }
+    
+    return offsetIndex;
+}
+
 void TrackvisDataSource::attach (const std::string &fileStem)
 {
     if (fileStream.is_open())
         fileStream.close();
     
     fileStream.open((fileStem + ".trk").c_str(), ios::binary);
+    this->fileStem = fileStem;
+    offsetIndex.clear();
+    indexLoaded = false;
     
     // Must be -1 if there is no seed property, for get()
     seedProperty = -1;
+    scalarNames.clear();
+    propertyNames.clear();
+    streamlineProperties.clear();
+    streamlinePropertyNames.clear();
     
     int32_t headerSize;
     fileStream.seekg(996);
@@ -114,7 +563,9 @@ void TrackvisDataSource::attach (const std::string &fileStem)
     
     fileStream.seekg(12, ios::cur);
     nScalars = binaryStream.readValue<int16_t>();
-    fileStream.seekg(200, ios::cur);
+    for (int i=0; i<std::min(nScalars,10); i++)
+        scalarNames.push_back(binaryStream.readString(20));
+    fileStream.seekg(200 - 20 * std::min(nScalars,10), ios::cur);
     nProperties = binaryStream.readValue<int16_t>();
     for (int i=0; i<std::min(nProperties,10); i++)
     {
@@ -122,12 +573,31 @@ void TrackvisDataSource::attach (const std::string &fileStem)
         propertyNames.push_back(propertyName);
         if (propertyName.compare(0,4,"seed") == 0)
             seedProperty = i;
+        else if (propertyName != "Ltermcode" && propertyName != "Rtermcode")
+        {
+            streamlineProperties.push_back(i);
+            streamlinePropertyNames.push_back(propertyName);
+        }
+    }
+    
+    // Only ten scalars and properties can be named, but any others are still kept
+    for (int i=10; i<nScalars; i++)
+        scalarNames.push_back("");
+    for (int i=10; i<nProperties; i++)
+    {
+        streamlineProperties.push_back(i);
+        streamlinePropertyNames.push_back("");
     }
     fileStream.seekg(440, ios::beg);
     binaryStream.readMatrix<float>(grid.transform());
     fileStream.seekg(988, ios::beg);
     totalStreamlines = binaryStream.readValue<int32_t>();
     
+    // A zero count means "unknown" to TrackVis, so take it from the index if there is any data
+    fileStream.seekg(0, ios::end);
+    if (totalStreamlines == 0 && static_cast<uint64_t>(fileStream.tellg()) > 1000)
+        totalStreamlines = getOffsetIndex().size();
+    
     fileStream.seekg(1000);
     currentStreamline = 0;
 }
@@ -145,7 +615,8 @@ void LabelledTrackvisDataSource::get (Streamline &data)
 {
     // This increments currentStreamline, so we subtract 1 below
     readStreamline(data);
-    data.setLabels(labelList->getLabels(currentStreamline-1));
+    const StreamlineLabelView labels = labelList->getLabels(currentStreamline-1);
+    data.setLabels(std::set<int>(labels.begin(), labels.end()));
 }
 
 void MedianTrackvisDataSource::get (Streamline &data)
@@ -154,76 +625,106 @@ void MedianTrackvisDataSource::get (Streamline &data)
         throw runtime_error("A meaningful median can't be recovered without knowing seed indices");
     
     const Eigen::Array3f voxelDims = grid.spacings();
-    vector<int> leftLengths(totalStreamlines), rightLengths(totalStreamlines);
+    const int stride = 3 + nScalars;
+    vector<int> leftLengths, rightLengths;
     
-    // First pass: find lengths
+    // First pass: find lengths; empty streamlines don't contribute
+    fileStream.seekg(1000);
     for (size_t i=0; i<totalStreamlines; i++)
     {
         const int32_t nPoints = binaryStream.readValue<int32_t>();
-        fileStream.seekg(4 * (nPoints*(3+nScalars) + seedProperty), ios::cur);
-        leftLengths[i] = static_cast<int>(binaryStream.readValue<float>()) + 1;
-        rightLengths[i] = nPoints - leftLengths[i] + 1;
+        fileStream.seekg(4 * (std::max(nPoints,0)*stride + seedProperty), ios::cur);
+        const int seed = static_cast<int>(binaryStream.readValue<float>());
         fileStream.seekg(4 * (nProperties-seedProperty-1), ios::cur);
+        if (nPoints > 0)
+        {
+            leftLengths.push_back(seed + 1);
+            rightLengths.push_back(nPoints - seed);
+        }
     }
     
-    const int lengthIndex = static_cast<int>(floor((totalStreamlines-1) * quantile));
+    if (leftLengths.empty())
+        throw runtime_error("There are no nonempty streamlines to take the median of");
+    
+    // Number of streamlines reaching each position on either side, up to the maximum length
+    const int maxLeftLength = *std::max_element(leftLengths.begin(), leftLengths.end());
+    const int maxRightLength = *std::max_element(rightLengths.begin(), rightLengths.end());
+    vector<size_t> leftCounts(maxLeftLength+1, 0), rightCounts(maxRightLength+1, 0);
+    for (size_t i=0; i<leftLengths.size(); i++)
+    {
+        leftCounts[leftLengths[i]-1]++;
+        rightCounts[rightLengths[i]-1]++;
+    }
+    for (int j=maxLeftLength-1; j>0; j--)
+        leftCounts[j-1] += leftCounts[j];
+    for (int j=maxRightLength-1; j>0; j--)
+        rightCounts[j-1] += rightCounts[j];
+    
+    // Selection reorders the lengths, but they aren't needed again
+    const int lengthIndex = static_cast<int>(floor((leftLengths.size()-1) * quantile));
     const int leftLength = getNthElement(leftLengths, lengthIndex);
     const int rightLength = getNthElement(rightLengths, lengthIndex);
     
-    // Second pass: left points
-    vector<Space<3>::Point> leftPoints(leftLength);
-    for (int j=0; j<leftLength; j++)
+    // Positions along the median are numbered left then right, and gathered
+    // into coordinate columns in as few sequential passes as the memory
+    // budget allows. Each pass covers positions [first,last)
+    const int nPositions = leftLength + rightLength;
+    vector<Space<3>::Point> leftPoints(leftLength), rightPoints(rightLength);
+    int first = 0;
+    while (first < nPositions)
     {
-        vector<float> x, y, z;
-        fileStream.seekg(1000);
+        int last = first;
+        size_t bytes = 0;
+        while (last < nPositions)
+        {
+            const size_t count = (last < leftLength ? leftCounts[last] : rightCounts[last-leftLength]);
+            if (last > first && bytes + 12 * count > memoryLimit)
+                break;
+            bytes += 12 * count;
+            last++;
+        }
         
+        vector< vector<float> > columns(3 * (last-first));
+        for (int k=first; k<last; k++)
+        {
+            const size_t count = (k < leftLength ? leftCounts[k] : rightCounts[k-leftLength]);
+            for (int l=0; l<3; l++)
+                columns[3*(k-first)+l].reserve(count);
+        }
+        
+        fileStream.seekg(1000);
         for (size_t i=0; i<totalStreamlines; i++)
         {
-            // Skip over this streamline if it is too short
-            if (leftLengths[i] <= j)
-                fileStream.seekg(4 * (1 + (leftLengths[i]+rightLengths[i]-1)*(3+nScalars) + nProperties), ios::cur);
-            else
+            const int32_t nPoints = binaryStream.readValue<int32_t>();
+            pointBuffer.resize(std::max(nPoints,0) * stride + nProperties);
+            if (!pointBuffer.empty())
+                binaryStream.readArray<float>(&pointBuffer[0], pointBuffer.size());
+            if (nPoints <= 0)
+                continue;
+            
+            const int seed = static_cast<int>(pointBuffer[nPoints * stride + seedProperty]);
+            for (int k=first; k<last; k++)
             {
-                fileStream.seekg(4 * (1 + (leftLengths[i]-1-j)*(3+nScalars)), ios::cur);
-                x.push_back(binaryStream.readValue<float>());
-                y.push_back(binaryStream.readValue<float>());
-                z.push_back(binaryStream.readValue<float>());
-                fileStream.seekg(4 * (nScalars + (j+rightLengths[i]-1)*(3+nScalars) + nProperties), ios::cur);
+                // Left positions count back from the seed, right ones forward
+                const int index = (k < leftLength ? seed - k : seed + (k - leftLength));
+                if (index < 0 || index >= nPoints)
+                    continue;
+                for (int l=0; l<3; l++)
+                    columns[3*(k-first)+l].push_back(pointBuffer[index * stride + l]);
             }
         }
         
-        const int medianIndex = static_cast<int>(round(x.size()/2.0));
-        leftPoints[j][0] = getNthElement(x, medianIndex) / voxelDims[0] - 0.5;
-        leftPoints[j][1] = getNthElement(y, medianIndex) / voxelDims[1] - 0.5;
-        leftPoints[j][2] = getNthElement(z, medianIndex) / voxelDims[2] - 0.5;
-    }
-    
-    // Third pass: right points
-    vector<Space<3>::Point> rightPoints(rightLength);
-    for (int j=0; j<rightLength; j++)
-    {
-        vector<float> x, y, z;
-        fileStream.seekg(1000);
-        
-        for (size_t i=0; i<totalStreamlines; i++)
+        for (int k=first; k<last; k++)
         {
-            // Skip over this streamline if it is too short
-            if (rightLengths[i] <= j)
-                fileStream.seekg(4 * (1 + (leftLengths[i]+rightLengths[i]-1)*(3+nScalars) + nProperties), ios::cur);
-            else
+            Space<3>::Point &point = (k < leftLength ? leftPoints[k] : rightPoints[k-leftLength]);
+            for (int l=0; l<3; l++)
             {
-                fileStream.seekg(4 * (1 + (leftLengths[i]+j-1)*(3+nScalars)), ios::cur);
-                x.push_back(binaryStream.readValue<float>());
-                y.push_back(binaryStream.readValue<float>());
-                z.push_back(binaryStream.readValue<float>());
-                fileStream.seekg(4 * (nScalars + (rightLengths[i]-j-1)*(3+nScalars) + nProperties), ios::cur);
+                vector<float> &column = columns[3*(k-first)+l];
+                point[l] = getNthElement(column, medianIndex(column.size())) / voxelDims[l] - 0.5;
             }
         }
         
-        const int medianIndex = static_cast<int>(round(x.size()/2.0));
-        rightPoints[j][0] = getNthElement(x, medianIndex) / voxelDims[0] - 0.5;
-        rightPoints[j][1] = getNthElement(y, medianIndex) / voxelDims[1] - 0.5;
-        rightPoints[j][2] = getNthElement(z, medianIndex) / voxelDims[2] - 0.5;
+        first = last;
     }
     
     data = Streamline(leftPoints, rightPoints, Streamline::VoxelPointType, voxelDims, false);
@@ -233,15 +734,8 @@ void MedianTrackvisDataSource::get (Streamline &data)
 
 void BasicTrackvisDataSource::seek (const int n)
 {
-    if (n < currentStreamline)
-        throw std::runtime_error("Cannot seek backwards");
-    
-    while (currentStreamline < n)
-    {
-        const int nPoints = binaryStream.readValue<int32_t>();
-        fileStream.seekg(4 * ((3+nScalars) * nPoints + nProperties), ios::cur);
-        currentStreamline++;
-    }
+    fileStream.seekg(getOffsetIndex().getOffset(n));
+    currentStreamline = n;
 }
 
 void LabelledTrackvisDataSource::seek (const int n)
@@ -250,34 +744,185 @@ void LabelledTrackvisDataSource::seek (const int n)
     currentStreamline = n;
 }
 
-void TrackvisDataSink::writeStreamline (const Streamline &data)
+// Append a value to a byte buffer, in native byte order
+template <typename Type>
+inline void appendValue (std::vector<char> &buffer, const Type value)
 {
-    int nPoints = data.nPoints();
-    Eigen::ArrayX3f points;
+    const size_t start = buffer.size();
+    buffer.resize(start + sizeof(Type));
+    memcpy(&buffer[start], &value, sizeof(Type));
+}
+
+// Encoded output is handed to the writer thread once it reaches this size,
+// or at the end of each block
+static const size_t outputBufferSize = 4194304;
+
+// Write the scalar and property counts and names, starting at the current
+// position in the header. The seed index and termination codes are always
+// the first three properties
+void TrackvisDataSink::writeFields ()
+{
+    binaryStream.writeValue<int16_t>(scalarNames.size());
+    for (size_t i=0; i<scalarNames.size(); i++)
+    {
+        fileStream.write(scalarNames[i].c_str(), scalarNames[i].length());
+        binaryStream.writeValues<char>(0, 20 - scalarNames[i].length());
+    }
+    binaryStream.writeValues<char>(0, 20 * (10 - scalarNames.size()));
     
-    data.concatenatePoints(points);
+    binaryStream.writeValue<int16_t>(3 + propertyNames.size());
+    fileStream.write("seed", 4);
+    binaryStream.writeValues<char>(0, 16);
+    fileStream.write("Ltermcode", 9);
+    binaryStream.writeValues<char>(0, 11);
+    fileStream.write("Rtermcode", 9);
+    binaryStream.writeValues<char>(0, 11);
+    for (size_t i=0; i<propertyNames.size(); i++)
+    {
+        fileStream.write(propertyNames[i].c_str(), propertyNames[i].length());
+        binaryStream.writeValues<char>(0, 20 - propertyNames[i].length());
+    }
+    binaryStream.writeValues<char>(0, 20 * (7 - propertyNames.size()));
+}
+
+void TrackvisDataSink::setFields (const std::vector<std::string> &scalarNames, const std::vector<std::string> &propertyNames)
+{
+    if (append)
+    {
+        if (scalarNames != this->scalarNames || propertyNames != this->propertyNames)
+            throw runtime_error("Scalars and properties don't match those of the Trackvis file being appended to");
+        return;
+    }
+    else if (totalStreamlines > 0 || filePosition > 1000)
+        throw runtime_error("Scalars and properties must be set before any streamlines are written");
     
-    binaryStream.writeValue<int32_t>(nPoints);
-    for (int i=0; i<nPoints; i++)
+    // The header has room for ten names of each type, each up to 20 characters
+    if (scalarNames.size() > 10 || propertyNames.size() > 7)
+        throw invalid_argument("Trackvis files can store up to 10 scalars and 7 additional properties");
+    for (size_t i=0; i<scalarNames.size(); i++)
     {
-        // TrackVis indexes from the left edge of each voxel
-        Eigen::Array3f row;
-        if (data.getPointType() == Streamline::VoxelPointType)
-            row = (points.row(i) + 0.5) * grid.spacings().transpose();
-        else
-            row = points.row(i) + (0.5 * grid.spacings().transpose());
-        binaryStream.writeVector<float>(row);
+        if (scalarNames[i].length() > 20)
+            throw invalid_argument("Trackvis scalar names can be no more than 20 characters long");
+    }
+    for (size_t i=0; i<propertyNames.size(); i++)
+    {
+        if (propertyNames[i].length() > 20)
+            throw invalid_argument("Trackvis property names can be no more than 20 characters long");
+    }
+    
+    this->scalarNames = scalarNames;
+    this->propertyNames = propertyNames;
+    fileStream.seekp(36);
+    writeFields();
+    fileStream.seekp(filePosition);
+}
+
+void TrackvisDataSink::writeStreamline (const Streamline &original)
+{
+    // Only a copy is simplified, since the original may go to other sinks
+    Streamline simplified;
+    if (tolerance > 0.0)
+    {
+        simplified = original;
+        simplified.simplify(tolerance);
     }
+    const Streamline &data = (tolerance > 0.0 ? simplified : original);
+    
+    const int nPoints = data.nPoints();
+    const int nScalars = static_cast<int>(scalarNames.size());
+    const int nProperties = static_cast<int>(propertyNames.size());
+    const int stride = 3 + nScalars;
+    
+    // Scalars and properties must match the file, if it has any
+    if (nScalars > 0 && data.nScalars() != nScalars)
+        throw runtime_error("Streamline scalars don't match those of the Trackvis file");
+    if (nProperties > 0 && data.nProperties() != nProperties)
+        throw runtime_error("Streamline properties don't match those of the Trackvis file");
+    
+    if (indexed)
+        offsetIndex.append(filePosition + outputBuffer.size());
     
     // In practice, we should be able to squeeze the seed index into a float, but check
     const size_t seedIndex = data.getSeedIndex();
     if (seedIndex > 16777216)
         Rf_warning("Seed index %lu is not representable exactly as a 32-bit floating point value\n", seedIndex);
-    binaryStream.writeValue<float>(seedIndex);
     
-    // Store termination reasons
-    binaryStream.writeValue(static_cast<float>(data.getLeftTerminationReason()));
-    binaryStream.writeValue(static_cast<float>(data.getRightTerminationReason()));
+    // Make room for the point count, points and properties, and encode in place
+    const size_t start = outputBuffer.size();
+    outputBuffer.resize(start + sizeof(int32_t) + sizeof(float) * (stride*nPoints + 3 + nProperties));
+    const int32_t count = nPoints;
+    memcpy(&outputBuffer[start], &count, sizeof(int32_t));
+    float *values = reinterpret_cast<float *>(&outputBuffer[start + sizeof(int32_t)]);
+    
+    // TrackVis indexes from the left edge of each voxel
+    Eigen::Array3f offset, scale;
+    if (data.getPointType() == Streamline::VoxelPointType)
+    {
+        offset.setConstant(0.5);
+        scale = grid.spacings();
+    }
+    else
+    {
+        offset = 0.5 * grid.spacings();
+        scale.setOnes();
+    }
+    
+    // Empty streamlines, such as median placeholders, have no points to write
+    if (nPoints > 0)
+    {
+        // Left points run back from the far end; the seed is shared with the right side
+        const std::vector<Space<3>::Point> &leftPoints = data.getLeftPoints();
+        const std::vector<Space<3>::Point> &rightPoints = data.getRightPoints();
+        int index = 0;
+        for (size_t i=leftPoints.size(); i>1; i--, index++)
+            Eigen::Map<Eigen::Array3f>(values + stride*index) = (leftPoints[i-1] + offset) * scale;
+        if (rightPoints.empty())
+            Eigen::Map<Eigen::Array3f>(values + stride*index) = (leftPoints[0] + offset) * scale;
+        else
+        {
+            for (size_t i=0; i<rightPoints.size(); i++, index++)
+                Eigen::Map<Eigen::Array3f>(values + stride*index) = (rightPoints[i] + offset) * scale;
+        }
+        
+        // Scalars follow the coordinates of each point, in the same order
+        if (nScalars > 0)
+        {
+            const std::vector<float> &leftScalars = data.getLeftScalars();
+            const std::vector<float> &rightScalars = data.getRightScalars();
+            index = 0;
+            for (size_t i=leftPoints.size(); i>1; i--, index++)
+                std::copy(&leftScalars[(i-1)*nScalars], &leftScalars[(i-1)*nScalars] + nScalars, values + stride*index + 3);
+            if (rightPoints.empty())
+                std::copy(&leftScalars[0], &leftScalars[0] + nScalars, values + stride*index + 3);
+            else
+            {
+                for (size_t i=0; i<rightPoints.size(); i++, index++)
+                    std::copy(&rightScalars[i*nScalars], &rightScalars[i*nScalars] + nScalars, values + stride*index + 3);
+            }
+        }
+    }
+    
+    // Seed index and termination reasons, then any other properties
+    values[stride*nPoints] = seedIndex;
+    values[stride*nPoints+1] = static_cast<float>(data.getLeftTerminationReason());
+    values[stride*nPoints+2] = static_cast<float>(data.getRightTerminationReason());
+    if (nProperties > 0)
+        std::copy(data.getProperties().begin(), data.getProperties().end(), values + stride*nPoints + 3);
+    
+    if (outputBuffer.size() >= outputBufferSize)
+        submitOutput();
+}
+
+void TrackvisDataSink::submitOutput ()
+{
+    filePosition += outputBuffer.size();
+    writer.submit(outputBuffer);
+}
+
+void TrackvisDataSink::flushOutput ()
+{
+    submitOutput();
+    writer.flush();
 }
 
 void TrackvisDataSink::attach (const std::string &fileStem)
@@ -285,6 +930,8 @@ void TrackvisDataSink::attach (const std::string &fileStem)
     if (fileStream.is_open())
         fileStream.close();
     
+    this->fileStem = fileStem;
+    
     if (append)
     {
         fileStream.open((fileStem + ".trk").c_str(), ios::in | ios::out | ios::binary);
@@ -292,10 +939,40 @@ void TrackvisDataSink::attach (const std::string &fileStem)
         int32_t existingStreamlines;
         fileStream.read((char *) &existingStreamlines, sizeof(int32_t));
         totalStreamlines = existingStreamlines;
+        
+        // Recover the field names, so that new streamlines match the old
+        char name[21] = { 0 };
+        int16_t nScalars, nProperties;
+        scalarNames.clear();
+        propertyNames.clear();
+        fileStream.seekg(36, ios::beg);
+        fileStream.read((char *) &nScalars, sizeof(int16_t));
+        for (int i=0; i<10; i++)
+        {
+            fileStream.read(name, 20);
+            if (i < nScalars)
+                scalarNames.push_back(name);
+        }
+        fileStream.read((char *) &nProperties, sizeof(int16_t));
+        for (int i=0; i<10; i++)
+        {
+            fileStream.read(name, 20);
+            if (i >= 3 && i < nProperties)
+                propertyNames.push_back(name);
+        }
+        if (nScalars > 10 || nProperties < 3 || nProperties > 10)
+            throw runtime_error("Trackvis file to append to does not have the expected scalars and properties");
+        
         fileStream.seekp(0, ios::end);
+        filePosition = fileStream.tellp();
+        
+        // The index can only be extended if it covers everything already there
+        indexed = offsetIndex.read(fileStem) && offsetIndex.size() == totalStreamlines;
         return;
     }
     
+    offsetIndex.clear();
+    
     fileStream.open((fileStem + ".trk").c_str(), ios::out | ios::binary | ios::trunc);
     
     char magicNumber[6] = { 'T','R','A','C','K','\0' };
@@ -306,15 +983,9 @@ void TrackvisDataSink::attach (const std::string &fileStem)
     binaryStream.writeVector<float>(grid.spacings(), 3);
     binaryStream.writeValues<float>(0.0, 3);
     
-    binaryStream.writeValue<int16_t>(0);
-    binaryStream.writeValues<char>(0, 200);
-    binaryStream.writeValue<int16_t>(3);
-    fileStream.write("seed", 4);
-    binaryStream.writeValues<char>(0, 16);
-    fileStream.write("Ltermcode", 9);
-    binaryStream.writeValues<char>(0, 11);
-    fileStream.write("Rtermcode", 9);
-    binaryStream.writeValues<char>(0, 151);
+    scalarNames.clear();
+    propertyNames.clear();
+    writeFields();
     
     const Eigen::Matrix4f xform = grid.transform();
     binaryStream.writeMatrix<float>(xform);
@@ -353,6 +1024,7 @@ void TrackvisDataSink::attach (const std::string &fileStem)
     binaryStream.writeValue<int32_t>(1000);
     
     totalStreamlines = 0;
+    filePosition = fileStream.tellp();
 }
 
 void LabelledTrackvisDataSink::attach (const std::string &fileStem)
@@ -362,6 +1034,14 @@ void LabelledTrackvisDataSink::attach (const std::string &fileStem)
     if (auxFileStream.is_open())
         auxFileStream.close();
     
+    if (append)
+    {
+        // The streamline count will be updated by done(), so just move to the end
+        auxFileStream.open((fileStem + ".trkl").c_str(), ios::in | ios::out | ios::binary);
+        auxFileStream.seekp(0, ios::end);
+        return;
+    }
+    
     auxFileStream.open((fileStem + ".trkl").c_str(), ios::binary);
     
     char magicNumber[8] = { 'T', 'R', 'K', 'L', 'A', 'B', 'E', 'L' };
@@ -399,127 +1079,337 @@ void TrackvisDataSink::setup (const size_type &count, const_iterator begin, cons
 
 void MedianTrackvisDataSink::setup (const size_type &count, const_iterator begin, const_iterator end)
 {
-    size_t i;
-    const_iterator it;
-    vector<int> leftLengths(count), rightLengths(count);
-    const Streamline::PointType pointType = begin->getPointType();
-    
-    // First pass: find lengths
-    for (it=begin, i=0; it!=end; it++, i++)
+    for (const_iterator it=begin; it!=end; it++)
     {
-        leftLengths[i] = it->getLeftPoints().size();
-        rightLengths[i] = it->getRightPoints().size();
+        // Empty streamlines don't contribute, as in MedianTrackvisDataSource
+        if (it->nPoints() == 0)
+            continue;
         
-        if (it->getPointType() != pointType)
+        if (nReceived == 0)
+            pointType = it->getPointType();
+        else if (it->getPointType() != pointType)
             throw std::runtime_error("Point types do not match across streamlines, so median will make no sense");
-    }
-    
-    const int lengthIndex = static_cast<int>(floor((count-1) * quantile));
-    const int leftLength = getNthElement(leftLengths, lengthIndex);
-    const int rightLength = getNthElement(rightLengths, lengthIndex);
-    
-    // Second pass: left points
-    vector<Space<3>::Point> leftPoints(leftLength);
-    for (int j=0; j<leftLength; j++)
-    {
-        vector<float> x, y, z;
         
-        for (it=begin, i=0; it!=end; it++, i++)
+        const std::vector<Space<3>::Point> *points[2] = { &it->getLeftPoints(), &it->getRightPoints() };
+        for (int side=0; side<2; side++)
         {
-            // Skip over this streamline if it is too short
-            if (leftLengths[i] > j)
+            const size_t length = points[side]->size();
+            if (lengthCounts[side].size() <= length)
+                lengthCounts[side].resize(length + 1, 0);
+            lengthCounts[side][length]++;
+            
+            if (approximate)
+            {
+                // Sketches cover the grid in the units of the points
+                while (sketches[side].size() < 3 * length)
+                {
+                    const int l = sketches[side].size() % 3;
+                    const double scale = (pointType == Streamline::VoxelPointType ? 1.0 : grid.spacings()[l]);
+                    sketches[side].push_back(QuantileHistogram(-0.5 * scale, (grid.dimensions()[l] - 0.5) * scale, sketchBins));
+                }
+                for (size_t j=0; j<length; j++)
+                {
+                    for (int l=0; l<3; l++)
+                        sketches[side][3*j+l].add((*points[side])[j][l]);
+                }
+            }
+            else
             {
-                const Space<3>::Point point = it->getLeftPoints()[j];
-                x.push_back(point[0]);
-                y.push_back(point[1]);
-                z.push_back(point[2]);
+                // Coordinates are interleaved within each column
+                if (columns[side].size() < length)
+                    columns[side].resize(length);
+                for (size_t j=0; j<length; j++)
+                {
+                    for (int l=0; l<3; l++)
+                        columns[side][j].push_back((*points[side])[j][l]);
+                }
+                columnBytes += 12 * length;
             }
         }
         
-        const int medianIndex = static_cast<int>(round(x.size()/2.0));
-        leftPoints[j][0] = getNthElement(x, medianIndex);
-        leftPoints[j][1] = getNthElement(y, medianIndex);
-        leftPoints[j][2] = getNthElement(z, medianIndex);
+        nReceived++;
+    }
+    
+    if (columnBytes > memoryLimit)
+        spill();
+}
+
+void MedianTrackvisDataSink::spill ()
+{
+    if (!spillStream.is_open())
+    {
+        spillPath = fileStem + ".trkspill";
+        spillStream.open(spillPath.c_str(), ios::in | ios::out | ios::binary | ios::trunc);
+        if (!spillStream.is_open())
+            throw std::runtime_error("Failed to open temporary file for median calculation");
     }
     
-    // Third pass: right points
-    vector<Space<3>::Point> rightPoints(rightLength);
-    for (int j=0; j<rightLength; j++)
+    BinaryOutputStream spillBinaryStream(&spillStream);
+    spillStream.seekp(spillPosition);
+    for (int side=0; side<2; side++)
     {
-        vector<float> x, y, z;
+        if (segments[side].size() < columns[side].size())
+            segments[side].resize(columns[side].size());
         
-        for (it=begin, i=0; it!=end; it++, i++)
+        for (size_t j=0; j<columns[side].size(); j++)
         {
-            // Skip over this streamline if it is too short
-            if (rightLengths[i] > j)
-            {
-                const Space<3>::Point point = it->getRightPoints()[j];
-                x.push_back(point[0]);
-                y.push_back(point[1]);
-                z.push_back(point[2]);
-            }
+            std::vector<float> &column = columns[side][j];
+            if (column.empty())
+                continue;
+            
+            const Segment segment = { spillPosition, column.size() };
+            segments[side][j].push_back(segment);
+            spillBinaryStream.writeArray<float>(&column[0], column.size());
+            spillPosition += 4 * column.size();
+            
+            // Release the memory, not just the contents
+            std::vector<float>().swap(column);
         }
-        
-        const int medianIndex = static_cast<int>(round(x.size()/2.0));
-        rightPoints[j][0] = getNthElement(x, medianIndex);
-        rightPoints[j][1] = getNthElement(y, medianIndex);
-        rightPoints[j][2] = getNthElement(z, medianIndex);
     }
     
-    // Fixed spacing won't be preserved in the median
-    median = Streamline(leftPoints, rightPoints, pointType, grid.spacings(), false);
+    if (spillStream.fail())
+        throw std::runtime_error("Failed to write temporary file for median calculation");
+    columnBytes = 0;
+}
+
+int MedianTrackvisDataSink::lengthQuantile (const int side) const
+{
+    // Equivalent to selecting the element at this index from all lengths
+    const size_t lengthIndex = static_cast<size_t>(floor((nReceived-1) * quantile));
+    size_t cumulative = 0;
+    for (size_t length=0; length<lengthCounts[side].size(); length++)
+    {
+        cumulative += lengthCounts[side][length];
+        if (cumulative > lengthIndex)
+            return static_cast<int>(length);
+    }
+    return static_cast<int>(lengthCounts[side].size()) - 1;
+}
+
+Space<3>::Point MedianTrackvisDataSink::medianPoint (const int side, const int position)
+{
+    Space<3>::Point point;
+    if (approximate)
+    {
+        for (int l=0; l<3; l++)
+        {
+            const QuantileHistogram &sketch = sketches[side][3*position+l];
+            point[l] = sketch.nthElement(medianIndex(sketch.size()));
+        }
+        return point;
+    }
+    
+    // Gather any spilled segments first, then what's still in memory
+    std::vector<float> values;
+    if (static_cast<size_t>(position) < segments[side].size())
+    {
+        BinaryInputStream spillBinaryStream(&spillStream);
+        const std::vector<Segment> &positionSegments = segments[side][position];
+        for (size_t i=0; i<positionSegments.size(); i++)
+        {
+            const size_t start = values.size();
+            values.resize(start + positionSegments[i].count);
+            spillStream.seekg(positionSegments[i].offset);
+            spillBinaryStream.readArray<float>(&values[start], positionSegments[i].count);
+        }
+        if (spillStream.fail())
+            throw std::runtime_error("Failed to read temporary file for median calculation");
+    }
+    if (static_cast<size_t>(position) < columns[side].size())
+    {
+        values.insert(values.end(), columns[side][position].begin(), columns[side][position].end());
+        std::vector<float>().swap(columns[side][position]);
+    }
+    
+    const size_t n = values.size() / 3;
+    const size_t index = medianIndex(n);
+    std::vector<float> coordinates(n);
+    for (int l=0; l<3; l++)
+    {
+        for (size_t i=0; i<n; i++)
+            coordinates[i] = values[3*i+l];
+        point[l] = getNthElement(coordinates, index);
+    }
+    return point;
 }
 
 void LabelledTrackvisDataSink::put (const Streamline &data)
 {
-    // Write the offset of this streamline into the file
-    auxBinaryStream.writeValue<uint64_t>(fileStream.tellp());
+    // Record the offset that this streamline will have in the file
+    appendValue<uint64_t>(auxOutputBuffer, filePosition + outputBuffer.size());
     
     writeStreamline(data);
     
     const std::set<int> &labels = data.getLabels();
-    auxBinaryStream.writeValue<int32_t>(labels.size());
+    appendValue<int32_t>(auxOutputBuffer, labels.size());
     for (std::set<int>::const_iterator it=labels.begin(); it!=labels.end(); it++)
-        auxBinaryStream.writeValue<int32_t>(*it);
+        appendValue<int32_t>(auxOutputBuffer, *it);
+    
+    if (auxOutputBuffer.size() >= outputBufferSize)
+        auxWriter.submit(auxOutputBuffer);
+}
+
+void TrackvisDataSink::finish ()
+{
+    // The block is written in the background while the next one is generated
+    submitOutput();
+}
+
+void LabelledTrackvisDataSink::finish ()
+{
+    TrackvisDataSink::finish();
+    auxWriter.submit(auxOutputBuffer);
 }
 
 void TrackvisDataSink::done ()
 {
+    flushOutput();
     fileStream.seekp(988);
     binaryStream.writeValue<int32_t>(totalStreamlines);
+    fileStream.flush();
+    
+    if (indexed)
+    {
+        offsetIndex.setFileSize(filePosition);
+        offsetIndex.write(fileStem);
+    }
 }
 
 void LabelledTrackvisDataSink::done ()
 {
     TrackvisDataSink::done();
     
+    auxWriter.submit(auxOutputBuffer);
+    auxWriter.flush();
     auxFileStream.seekp(12);
     auxBinaryStream.writeValue<int32_t>(totalStreamlines);
 }
 
-void MedianTrackvisDataSink::done ()
+void TrackvisDataSink::saveState (BinaryOutputStream &stream)
 {
+    // Bring the header up to date, so that the partial file is valid in its own right
+    flushOutput();
     fileStream.seekp(988);
-    binaryStream.writeValue<int32_t>(1);
+    binaryStream.writeValue<int32_t>(totalStreamlines);
+    fileStream.seekp(0, ios::end);
+    fileStream.flush();
+    
+    if (indexed)
+    {
+        offsetIndex.setFileSize(filePosition);
+        offsetIndex.write(fileStem);
+    }
     
-    fileStream.seekp(1000);
-    writeStreamline(median);
+    stream.writeValue<uint64_t>(fileStream.tellp());
+    stream.writeValue<uint64_t>(totalStreamlines);
 }
 
-void StreamlineLabelList::read (const std::string &fileStem)
+void TrackvisDataSink::restoreState (BinaryInputStream &stream)
 {
-    if (fileStream.is_open())
-        fileStream.close();
+    const uint64_t length = stream.readValue<uint64_t>();
+    totalStreamlines = stream.readValue<uint64_t>();
     
-    fileStream.open((fileStem + ".trkl").c_str(), ios::binary);
-    fileStream.seekg(0);
+    if (!append)
+        throw std::runtime_error("Trackvis file must be opened for appending to be restored from a checkpoint");
+    
+    fileStream.seekp(0, ios::end);
+    if (static_cast<uint64_t>(fileStream.tellp()) < length)
+        throw std::runtime_error("Trackvis file is shorter than its checkpointed length");
+    
+    fileStream.close();
+    truncateFile(fileStem + ".trk", length);
+    fileStream.open((fileStem + ".trk").c_str(), ios::in | ios::out | ios::binary);
+    fileStream.seekp(0, ios::end);
+    filePosition = length;
+    
+    // The index saved with the checkpoint matches the truncated file
+    indexed = offsetIndex.read(fileStem) && offsetIndex.size() == totalStreamlines;
+}
+
+void LabelledTrackvisDataSink::saveState (BinaryOutputStream &stream)
+{
+    TrackvisDataSink::saveState(stream);
+    
+    auxWriter.submit(auxOutputBuffer);
+    auxWriter.flush();
+    auxFileStream.seekp(12);
+    auxBinaryStream.writeValue<int32_t>(totalStreamlines);
+    auxFileStream.seekp(0, ios::end);
+    auxFileStream.flush();
+    
+    stream.writeValue<uint64_t>(auxFileStream.tellp());
+}
+
+void LabelledTrackvisDataSink::restoreState (BinaryInputStream &stream)
+{
+    TrackvisDataSink::restoreState(stream);
+    
+    const uint64_t length = stream.readValue<uint64_t>();
+    auxFileStream.seekp(0, ios::end);
+    if (static_cast<uint64_t>(auxFileStream.tellp()) < length)
+        throw std::runtime_error("Streamline label file is shorter than its checkpointed length");
+    
+    auxFileStream.close();
+    truncateFile(fileStem + ".trkl", length);
+    auxFileStream.open((fileStem + ".trkl").c_str(), ios::in | ios::out | ios::binary);
+    auxFileStream.seekp(0, ios::end);
+}
+
+void MedianTrackvisDataSink::done ()
+{
+    // Any existing medians are kept in append mode, otherwise the file contains only the header
+    fileStream.seekp(0, ios::end);
+    
+    // If no streamlines were received, write an empty placeholder so that indices still match up
+    if (nReceived > 0)
+    {
+        if (spillStream.is_open())
+            spillStream.flush();
+        
+        std::vector<Space<3>::Point> points[2];
+        for (int side=0; side<2; side++)
+        {
+            points[side].resize(lengthQuantile(side));
+            for (size_t j=0; j<points[side].size(); j++)
+                points[side][j] = medianPoint(side, j);
+        }
+        
+        // Fixed spacing won't be preserved in the median
+        const Streamline median(points[0], points[1], pointType, grid.spacings(), false);
+        writeStreamline(median);
+        
+        if (spillStream.is_open())
+        {
+            spillStream.close();
+            std::remove(spillPath.c_str());
+        }
+    }
+    else
+    {
+        // The record layout matches writeStreamline(), but with no points there are no scalars
+        if (indexed)
+            offsetIndex.append(filePosition + outputBuffer.size());
+        appendValue<int32_t>(outputBuffer, 0);
+        for (size_t i=0; i<3+propertyNames.size(); i++)
+            appendValue<float>(outputBuffer, 0.0);
+    }
+    
+    totalStreamlines++;
+    TrackvisDataSink::done();
+}
+
+void StreamlineLabelList::read (const std::string &fileStem)
+{
+    std::ifstream fileStream((fileStem + ".trkl").c_str(), ios::binary);
+    BinaryInputStream binaryStream(&fileStream);
     if (binaryStream.readString(8).compare("TRKLABEL") != 0)
         throw runtime_error("Track label file does not seem to have a valid magic number");
     
     const int version = binaryStream.readValue<int32_t>();
-    binaryStream.swapEndianness(version > 0xffff);
+    swapEndian = (version > 0xffff);
+    binaryStream.swapEndianness(swapEndian);
     
-    const int nStreamlines = binaryStream.readValue<int32_t>();
+    nStreamlines = binaryStream.readValue<int32_t>();
     const int nLabels = binaryStream.readValue<int32_t>();
     fileStream.seekg(32);
     
@@ -529,33 +1419,229 @@ void StreamlineLabelList::read (const std::string &fileStem)
         binaryStream.readString();
     }
     
-    labelList.clear();
-    for (int j=0; j<nStreamlines; j++)
+    dataStart = fileStream.tellg();
+    fileName = fileStem + ".trkl";
+    
+    offsetList.clear();
+    labelStarts.clear();
+    labelData.clear();
+    loaded = false;
+    postings.clear();
+    indexed = false;
+}
+
+void StreamlineLabelList::load ()
+{
+    MemoryMappedFile file(fileName);
+    const char *data = file.begin();
+    const size_t length = file.size();
+    
+    // Each record is an offset, a count and the labels themselves, so the
+    // total number of labels follows from the file size
+    if (length < dataStart + 12 * nStreamlines)
+        throw runtime_error("Track label file is truncated");
+    const size_t nLabels = (length - dataStart - 12 * nStreamlines) / 4;
+    
+    offsetList.resize(nStreamlines);
+    labelStarts.resize(nStreamlines + 1);
+    labelData.resize(nLabels);
+    
+    size_t position = dataStart, start = 0;
+    for (size_t j=0; j<nStreamlines; j++)
     {
-        offsetList.push_back(static_cast<size_t>(binaryStream.readValue<uint64_t>()));
-        const int currentCount = binaryStream.readValue<int32_t>();
-        std::set<int> currentLabels;
-        for (int i=0; i<currentCount; i++)
-            currentLabels.insert(binaryStream.readValue<int32_t>());
-        labelList.push_back(currentLabels);
+        if (position + 12 > length)
+            throw runtime_error("Track label file is truncated");
+        
+        uint64_t offset;
+        int32_t count;
+        memcpy(&offset, data + position, 8);
+        memcpy(&count, data + position + 8, 4);
+        if (swapEndian)
+        {
+            swapBytes64(&offset, 1);
+            swapBytes32(reinterpret_cast<uint32_t *>(&count), 1);
+        }
+        position += 12;
+        
+        if (count < 0 || start + count > nLabels || position + 4 * count > length)
+            throw runtime_error("Track label file is truncated or corrupt");
+        
+        offsetList[j] = offset;
+        labelStarts[j] = start;
+        if (count > 0)
+            memcpy(&labelData[start], data + position, 4 * count);
+        position += 4 * count;
+        start += count;
     }
+    labelStarts[nStreamlines] = start;
+    labelData.resize(start);
+    
+    if (swapEndian && !labelData.empty())
+        swapBytes32(reinterpret_cast<uint32_t *>(&labelData[0]), labelData.size());
+    
+    loaded = true;
 }
 
-const std::vector<int> StreamlineLabelList::find (const std::vector<int> &labels)
+void StreamlineLabelList::buildIndex ()
 {
-    std::vector<int> indices;
-    for (int i=0; i<labelList.size(); i++)
+    // Streamlines are visited in order, so each posting list is sorted by construction
+    if (!loaded)
+        load();
+    
+    postings.clear();
+    for (size_t i=0; i<nStreamlines; i++)
     {
-        bool allPresent = true;
-        for (std::vector<int>::const_iterator it=labels.begin(); it!=labels.end(); it++)
+        const StreamlineLabelView labels = getLabels(i);
+        for (const int32_t *it=labels.begin(); it!=labels.end(); it++)
         {
-            if (labelList[i].count(*it) == 0)
-                allPresent = false;
+            std::vector<int> &list = postings[*it];
+            
+            // Labels may be repeated within a streamline
+            if (list.empty() || list.back() != static_cast<int>(i))
+                list.push_back(i);
         }
+    }
+    indexed = true;
+}
+
+const std::vector<int> & StreamlineLabelList::getPostings (const int label)
+{
+    if (!indexed)
+        buildIndex();
+    
+    std::map<int,std::vector<int> >::const_iterator it = postings.find(label);
+    if (it == postings.end())
+        return emptyPostings;
+    else
+        return it->second;
+}
+
+static bool shorterPostings (const std::vector<int> *a, const std::vector<int> *b)
+{
+    return (a->size() < b->size());
+}
+
+// Intersect two sorted lists; if one is much shorter, its elements are
+// searched for in the longer one rather than walking through both
+static void intersectPostings (const std::vector<int> &a, const std::vector<int> &b, std::vector<int> &result)
+{
+    result.clear();
+    const std::vector<int> &shorter = (a.size() <= b.size() ? a : b);
+    const std::vector<int> &longer = (a.size() <= b.size() ? b : a);
+    
+    if (shorter.size() * 16 < longer.size())
+    {
+        std::vector<int>::const_iterator position = longer.begin();
+        for (std::vector<int>::const_iterator it=shorter.begin(); it!=shorter.end(); it++)
+        {
+            position = std::lower_bound(position, longer.end(), *it);
+            if (position == longer.end())
+                break;
+            else if (*position == *it)
+                result.push_back(*it);
+        }
+    }
+    else
+        std::set_intersection(shorter.begin(), shorter.end(), longer.begin(), longer.end(), std::back_inserter(result));
+}
+
+const std::vector<int> StreamlineLabelList::find (const std::vector<int> &allLabels, const std::vector<int> &anyLabels, const std::vector<int> &noneLabels)
+{
+    std::vector<int> indices, temp;
+    
+    // Intersect the posting lists for the required labels, shortest first
+    if (!allLabels.empty())
+    {
+        std::vector<const std::vector<int> *> lists;
+        for (std::vector<int>::const_iterator it=allLabels.begin(); it!=allLabels.end(); it++)
+            lists.push_back(&getPostings(*it));
+        std::sort(lists.begin(), lists.end(), shorterPostings);
         
-        if (allPresent)
-            indices.push_back(i);
+        indices = *lists[0];
+        for (size_t i=1; i<lists.size() && !indices.empty(); i++)
+        {
+            intersectPostings(indices, *lists[i], temp);
+            indices.swap(temp);
+        }
+    }
+    
+    // Merge the lists for the alternative labels and intersect with the above
+    if (!anyLabels.empty())
+    {
+        std::vector<int> merged;
+        for (std::vector<int>::const_iterator it=anyLabels.begin(); it!=anyLabels.end(); it++)
+        {
+            const std::vector<int> &list = getPostings(*it);
+            merged.insert(merged.end(), list.begin(), list.end());
+        }
+        std::sort(merged.begin(), merged.end());
+        merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+        
+        if (allLabels.empty())
+            indices.swap(merged);
+        else
+        {
+            intersectPostings(indices, merged, temp);
+            indices.swap(temp);
+        }
+    }
+    
+    // With no positive criteria, every streamline is a candidate
+    if (allLabels.empty() && anyLabels.empty())
+    {
+        indices.resize(nStreamlines);
+        for (size_t i=0; i<nStreamlines; i++)
+            indices[i] = i;
+    }
+    
+    // Remove streamlines carrying any of the excluded labels
+    for (std::vector<int>::const_iterator it=noneLabels.begin(); it!=noneLabels.end() && !indices.empty(); it++)
+    {
+        const std::vector<int> &list = getPostings(*it);
+        temp.clear();
+        std::set_difference(indices.begin(), indices.end(), list.begin(), list.end(), std::back_inserter(temp));
+        indices.swap(temp);
     }
     
     return indices;
 }
+
+size_t StreamlineLabelList::count (const std::vector<int> &allLabels, const std::vector<int> &anyLabels, const std::vector<int> &noneLabels)
+{
+    // A single label can be answered from its posting list directly
+    if (allLabels.size() == 1 && anyLabels.empty() && noneLabels.empty())
+        return getPostings(allLabels[0]).size();
+    else
+        return find(allLabels, anyLabels, noneLabels).size();
+}
+
+Eigen::ArrayXXi StreamlineLabelList::coOccurrence (const std::vector<int> &labels)
+{
+    const int n = labels.size();
+    Eigen::ArrayXXi result(n, n);
+    std::vector<int> temp;
+    for (int i=0; i<n; i++)
+    {
+        const std::vector<int> &first = getPostings(labels[i]);
+        result(i,i) = first.size();
+        for (int j=i+1; j<n; j++)
+        {
+            intersectPostings(first, getPostings(labels[j]), temp);
+            result(i,j) = result(j,i) = temp.size();
+        }
+    }
+    return result;
+}
+
+size_t StreamlineLabelList::indexMemory ()
+{
+    if (!indexed)
+        buildIndex();
+    
+    // Each map node holds a key and a vector, plus three pointers and a colour flag
+    const size_t nodeSize = sizeof(std::pair<const int,std::vector<int> >) + 4 * sizeof(void *);
+    size_t bytes = sizeof(postings);
+    for (std::map<int,std::vector<int> >::const_iterator it=postings.begin(); it!=postings.end(); it++)
+        bytes += nodeSize + it->second.capacity() * sizeof(int);
+    return bytes;
+}
@@ -7,6 +7,47 @@
 #include "Streamline.h"
 #include "DataSource.h"
 #include "BinaryStream.h"
+#include "Checkpoint.h"
+#include "MemoryMappedFile.h"
+#include "AsyncWriter.h"
+#include "Quantile.h"
+
+// Byte offsets of the streamlines in a Trackvis file, allowing random access
+// in either direction. The index is stored alongside the file, with a .trki
+// suffix, and is only trusted if the file's size hasn't changed since
+class StreamlineOffsetIndex
+{
+private:
+    std::vector<uint64_t> offsets;
+    uint64_t fileSize;
+    
+public:
+    StreamlineOffsetIndex ()
+        : fileSize(0) {}
+    
+    // Returns false if there is no index or it is out of date
+    bool read (const std::string &fileStem);
+    void write (const std::string &fileStem) const;
+    
+    // Build the index by hopping from one streamline's point count to the next
+    void scan (const MemoryMappedFile &file, const int nScalars, const int nProperties, const bool swapEndian);
+    
+    void clear ()
+    {
+        offsets.clear();
+        fileSize = 0;
+    }
+    
+    void append (const uint64_t offset) { offsets.push_back(offset); }
+    void truncate (const size_t n) { offsets.resize(std::min(n, offsets.size())); }
+    void setFileSize (const uint64_t fileSize) { this->fileSize = fileSize; }
+    
+    size_t size () const { return offsets.size(); }
+    bool empty () const { return offsets.empty(); }
+    
+    // The offset one past the last streamline is the end of the file
+    uint64_t getOffset (const size_t n) const { return (n < offsets.size() ? offsets[n] : fileSize); }
+};
 
 // Base class for Trackvis readers: provides common functionality
 class TrackvisDataSource : public Griddable3D, public DataSource<Streamline>
@@ -15,16 +56,27 @@ protected:
     std::ifstream fileStream;
     BinaryInputStream binaryStream;
     int nScalars, nProperties, seedProperty;
-    std::vector<std::string> propertyNames;
+    std::vector<std::string> scalarNames, propertyNames;
+    
+    // Properties other than the seed index and termination codes, which are
+    // passed on to each streamline, with their names
+    std::vector<int> streamlineProperties;
+    std::vector<std::string> streamlinePropertyNames;
     size_t totalStreamlines, currentStreamline;
     Grid<3> grid;
+    std::vector<float> pointBuffer;
+    std::string fileStem;
+    StreamlineOffsetIndex offsetIndex;
+    bool indexLoaded;
     
     TrackvisDataSource ()
+        : indexLoaded(false)
     {
         binaryStream.attach(&fileStream);
     }
     
     TrackvisDataSource (const std::string &fileStem)
+        : indexLoaded(false)
     {
         binaryStream.attach(&fileStream);
         attach(fileStem);
@@ -32,6 +84,9 @@ protected:
     
     void readStreamline (Streamline &data);
     
+    // Read the offset index, or build it and try to store it for next time
+    const StreamlineOffsetIndex & getOffsetIndex ();
+    
 public:
     virtual ~TrackvisDataSource ()
     {
@@ -43,6 +98,8 @@ public:
     virtual void attach (const std::string &fileStem);
     Grid<3> getGrid3D () const { return grid; }
     const std::vector<std::string> & getPropertyNames () const { return propertyNames; }
+    const std::vector<std::string> & getScalarNames () const { return scalarNames; }
+    const std::vector<std::string> & getStreamlinePropertyNames () const { return streamlinePropertyNames; }
 };
 
 // Basic Trackvis reader: read all streamlines, including seed property
@@ -60,31 +117,185 @@ public:
     bool seekable () { return true; }
 };
 
-class StreamlineLabelList
+// A streamline's points as stored in a Trackvis file, viewed in place: each
+// point is converted to voxel coordinates only when accessed
+class StreamlinePointView
 {
 private:
-    std::ifstream fileStream;
-    BinaryInputStream binaryStream;
-    std::vector< std::set<int> > labelList;
-    std::vector<size_t> offsetList;
+    const float *data, *properties;
+    size_t nPoints;
+    int stride, seed;
+    Eigen::Array3f voxelDims;
     
 public:
-    StreamlineLabelList ()
+    StreamlinePointView ()
+        : data(NULL), properties(NULL), nPoints(0), stride(3), seed(0) {}
+    
+    StreamlinePointView (const float *data, const size_t nPoints, const int stride, const int seed, const Eigen::Array3f &voxelDims, const float *properties = NULL)
+        : data(data), properties(properties), nPoints(nPoints), stride(stride), seed(seed), voxelDims(voxelDims) {}
+    
+    size_t size () const { return nPoints; }
+    bool empty () const { return (nPoints == 0); }
+    int getSeedIndex () const { return seed; }
+    const Eigen::Array3f & getVoxelDimensions () const { return voxelDims; }
+    
+    // Raw coordinates, in mm from the corner of the image, with "stride" floats
+    // per point; any scalars follow the coordinates of each point
+    const float * raw () const { return data; }
+    int getStride () const { return stride; }
+    
+    // All of the streamline's properties, as stored in the file
+    const float * getProperties () const { return properties; }
+    
+    Space<3>::Point operator[] (const size_t i) const
     {
-        binaryStream.attach(&fileStream);
+        // TrackVis indexes from the left edge of each voxel
+        const float *point = data + i * stride;
+        return Space<3>::Point(point[0], point[1], point[2]) / voxelDims - 0.5;
+    }
+    
+    // Total length in mm, accumulated outwards from the seed on either side,
+    // exactly as for the equivalent Streamline object
+    double getLength () const;
+};
+
+// Memory-mapped Trackvis reader: streamlines are parsed where they lie in the
+// file, and byte-swapped in bulk only if the file's endianness differs.
+// Consumers can use point views to avoid creating Streamline objects at all
+// With several threads, blocks and subsets are decoded in parallel, using
+// the offset index to find each streamline, and delivered in order
+class MappedTrackvisDataSource : public TrackvisDataSource
+{
+protected:
+    MemoryMappedFile file;
+    size_t offset;
+    std::vector<float> swapBuffer;
+    int nThreads;
+    
+    int32_t readInt (const size_t position) const;
+    float readFloat (const size_t position) const;
+    void skip ();
+    
+    // View the streamline at a file offset, returning the offset of the next
+    // one; byte-swapped points are placed in the buffer given
+    size_t locate (const size_t position, StreamlinePointView &view, std::vector<float> &buffer) const;
+    void decode (const StreamlinePointView &view, Streamline &data) const;
+    void decodeElements (std::list<Streamline> &block, const std::vector<size_t> &indices);
+    
+public:
+    MappedTrackvisDataSource (const std::string &fileStem)
+        : TrackvisDataSource(fileStem), offset(1000), nThreads(1)
+    {
+        file.open(fileStem + ".trk");
     }
     
+    size_t nStreamlines () const { return totalStreamlines; }
+    void setThreads (const int nThreads) { this->nThreads = std::max(nThreads, 1); }
+    
+    // View the next streamline's points and move past it; the view remains valid until the next call
+    void getView (StreamlinePointView &view);
+    
+    // Lengths of the specified streamlines, or all of them if no indices are
+    // given, calculated from point views in parallel
+    std::vector<double> getLengths (const std::vector<size_t> &indices = std::vector<size_t>());
+    
+    bool more () { return (currentStreamline < totalStreamlines); }
+    void get (Streamline &data);
+    size_t getBlock (std::list<Streamline> &block, const size_t n);
+    size_t getElements (std::list<Streamline> &block, const std::vector<size_t> &indices);
+    void seek (const int n);
+    bool seekable () { return true; }
+};
+
+// A streamline's labels, viewed in place within a label list
+class StreamlineLabelView
+{
+private:
+    const int32_t *data;
+    size_t n;
+    
+public:
+    StreamlineLabelView ()
+        : data(NULL), n(0) {}
+    
+    StreamlineLabelView (const int32_t *data, const size_t n)
+        : data(data), n(n) {}
+    
+    size_t size () const { return n; }
+    bool empty () const { return (n == 0); }
+    const int32_t * begin () const { return data; }
+    const int32_t * end () const { return data + n; }
+    int operator[] (const size_t i) const { return data[i]; }
+};
+
+// Labels associated with each streamline in a .trkl file. Opening the file
+// reads only its header; the labels themselves are loaded in a single pass
+// over the mapped file when first needed, and stored in compressed sparse
+// row form, as one flat array with the start of each streamline's labels
+// recorded separately. Queries are answered from an inverted index, mapping
+// each label to the sorted list of streamlines carrying it, which is also
+// built the first time it is needed
+class StreamlineLabelList
+{
+private:
+    std::string fileName;
+    size_t nStreamlines, dataStart;
+    bool swapEndian;
+    
+    bool loaded;
+    std::vector<uint64_t> offsetList;
+    std::vector<uint64_t> labelStarts;
+    std::vector<int32_t> labelData;
+    
+    bool indexed;
+    std::map<int,std::vector<int> > postings;
+    std::vector<int> emptyPostings;
+    
+    void load ();
+    void buildIndex ();
+    const std::vector<int> & getPostings (const int label);
+    
+public:
+    StreamlineLabelList ()
+        : nStreamlines(0), dataStart(0), swapEndian(false), loaded(false), indexed(false) {}
+    
     StreamlineLabelList (const std::string &fileStem)
+        : nStreamlines(0), dataStart(0), swapEndian(false), loaded(false), indexed(false)
     {
-        binaryStream.attach(&fileStream);
         read(fileStem);
     }
     
     void read (const std::string &fileStem);
-    const std::vector<int> find (const std::vector<int> &labels);
-    size_t size () { return labelList.size(); }
-    const std::set<int> & getLabels (const int n) { return labelList[n]; }
-    size_t getOffset (const int n) { return offsetList[n]; }
+    
+    // Streamlines carrying all of the first set of labels, at least one of
+    // the second (if it isn't empty) and none of the third
+    const std::vector<int> find (const std::vector<int> &allLabels, const std::vector<int> &anyLabels = std::vector<int>(), const std::vector<int> &noneLabels = std::vector<int>());
+    size_t count (const std::vector<int> &allLabels, const std::vector<int> &anyLabels = std::vector<int>(), const std::vector<int> &noneLabels = std::vector<int>());
+    
+    // Numbers of streamlines carrying each pair of labels, with single label counts on the diagonal
+    Eigen::ArrayXXi coOccurrence (const std::vector<int> &labels);
+    
+    // Approximate memory used by the inverted index, in bytes, building it if necessary
+    size_t indexMemory ();
+    
+    // The index is built on first use, so this is false until then
+    bool isIndexed () const { return indexed; }
+    
+    size_t size () const { return nStreamlines; }
+    
+    StreamlineLabelView getLabels (const size_t n)
+    {
+        if (!loaded)
+            load();
+        return StreamlineLabelView(labelData.data() + labelStarts[n], labelStarts[n+1] - labelStarts[n]);
+    }
+    
+    size_t getOffset (const size_t n)
+    {
+        if (!loaded)
+            load();
+        return offsetList[n];
+    }
 };
 
 // Labelled Trackvis reader: also read auxiliary file containing label info
@@ -126,57 +337,89 @@ public:
     bool seekable () { return true; }
 };
 
-// Median Trackvis reader: construct and return median streamline only
+// Median Trackvis reader: construct and return median streamline only. The
+// file is read sequentially, with coordinates for each position along the
+// median gathered into columns; if the columns would exceed the memory
+// limit, positions are split over several passes
 class MedianTrackvisDataSource : public TrackvisDataSource
 {
 protected:
     bool read;
     double quantile;
+    size_t memoryLimit;
     
 public:
     MedianTrackvisDataSource ()
-        : read(false) {}
+        : read(false), memoryLimit(268435456) {}
     
     MedianTrackvisDataSource (const std::string &fileStem, const double quantile = 0.99)
-        : TrackvisDataSource(fileStem), quantile(quantile), read(false) {}
+        : TrackvisDataSource(fileStem), quantile(quantile), read(false), memoryLimit(268435456) {}
+    
+    void setMemoryLimit (const size_t bytes) { memoryLimit = bytes; }
     
     bool more () { return (!read); }
     void get (Streamline &data);
 };
 
-class TrackvisDataSink : public Griddable3D, public DataSink<Streamline>
+class TrackvisDataSink : public Griddable3D, public DataSink<Streamline>, public Checkpointable
 {
 protected:
+    std::string fileStem;
     std::fstream fileStream;
     BinaryOutputStream binaryStream;
     size_t totalStreamlines;
     Grid<3> grid;
     bool append;
     
+    // Names of per-point scalars, and of properties stored after the seed
+    // index and termination codes of each streamline
+    std::vector<std::string> scalarNames, propertyNames;
+    
+    // Streamlines are simplified before being written if this is positive
+    double tolerance;
+    
+    // Encoded streamlines accumulate here and are handed to the writer
+    // thread a buffer at a time; the file position is tracked separately
+    // because the stream itself lags behind
+    std::vector<char> outputBuffer;
+    AsyncWriter writer;
+    uint64_t filePosition;
+    
+    // An offset index is written alongside the file unless, when appending,
+    // there is no up-to-date index to extend
+    bool indexed;
+    StreamlineOffsetIndex offsetIndex;
+    
     TrackvisDataSink ()
-        : append(false)
+        : append(false), tolerance(0.0), indexed(true)
     {
         binaryStream.attach(&fileStream);
         binaryStream.swapEndianness(false);
+        writer.attach(&fileStream);
     }
     
     TrackvisDataSink (const std::string &fileStem, const bool append = false)
-        : append(append)
+        : append(append), tolerance(0.0), indexed(true)
     {
         binaryStream.attach(&fileStream);
         binaryStream.swapEndianness(false);
+        writer.attach(&fileStream);
         attach(fileStem);
     }
     
     TrackvisDataSink (const std::string &fileStem, const Grid<3> &grid, const bool append = false)
-        : grid(grid), append(append)
+        : grid(grid), append(append), tolerance(0.0), indexed(true)
     {
         binaryStream.attach(&fileStream);
         binaryStream.swapEndianness(false);
+        writer.attach(&fileStream);
         attach(fileStem);
     }
     
+    void writeFields ();
     void writeStreamline (const Streamline &data);
+    void submitOutput ();
+    void flushOutput ();
     
 public:
     static std::map<int,char> orientationCodeMap;
@@ -193,8 +436,16 @@ public:
         return map;
     }
     
+    // Streamlines still buffered are written out, as they would have been
+    // if the file had been closed properly, but errors go unreported
     virtual ~TrackvisDataSink ()
     {
+        try
+        {
+            submitOutput();
+            writer.stop();
+        }
+        catch (...) {}
         binaryStream.detach();
         if (fileStream.is_open())
             fileStream.close();
@@ -202,8 +453,24 @@ public:
     
     virtual void attach (const std::string &fileStem);
     void setup (const size_type &count, const_iterator begin, const_iterator end);
+    void finish ();
     void done ();
     Grid<3> getGrid3D () const { return grid; }
+    
+    // Name the scalars and properties to be stored with each streamline,
+    // before any are written (or, when appending, check that they match the
+    // file). Streamlines must then carry exactly these; if no names are set,
+    // any scalars and properties the streamlines carry are not stored
+    void setFields (const std::vector<std::string> &scalarNames, const std::vector<std::string> &propertyNames);
+    
+    // Simplify streamlines to within the tolerance (in world units) as they
+    // are written, without affecting what other sinks receive
+    void setTolerance (const double tolerance) { this->tolerance = tolerance; }
+    
+    // The saved state is the file length and streamline count; on restore
+    // (in append mode) anything written after the checkpoint is discarded
+    virtual void saveState (BinaryOutputStream &stream);
+    virtual void restoreState (BinaryInputStream &stream);
 };
 
 class BasicTrackvisDataSink : public TrackvisDataSink
@@ -229,26 +496,37 @@ protected:
     std::ofstream auxFileStream;
     BinaryOutputStream auxBinaryStream;
     std::map<int,std::string> labelDictionary;
+    std::vector<char> auxOutputBuffer;
+    AsyncWriter auxWriter;
     
 public:
     LabelledTrackvisDataSink ()
     {
         auxBinaryStream.attach(&auxFileStream);
         auxBinaryStream.swapEndianness(false);
+        auxWriter.attach(&auxFileStream);
     }
     
     // Don't call base class constructor explicitly here
-    LabelledTrackvisDataSink (const std::string &fileStem, const Grid<3> &grid, const std::map<int,std::string> labelDictionary)
+    LabelledTrackvisDataSink (const std::string &fileStem, const Grid<3> &grid, const std::map<int,std::string> labelDictionary, const bool append = false)
         : labelDictionary(labelDictionary)
     {
         this->grid = grid;
+        this->append = append;
         auxBinaryStream.attach(&auxFileStream);
         auxBinaryStream.swapEndianness(false);
+        auxWriter.attach(&auxFileStream);
         attach(fileStem);
     }
     
     ~LabelledTrackvisDataSink ()
     {
+        try
+        {
+            auxWriter.submit(auxOutputBuffer);
+            auxWriter.stop();
+        }
+        catch (...) {}
         auxBinaryStream.detach();
         if (auxFileStream.is_open())
             auxFileStream.close();
@@ -256,21 +534,76 @@ public:
     
     void attach (const std::string &fileStem);
     void put (const Streamline &data);
+    void finish ();
     void done ();
+    
+    void saveState (BinaryOutputStream &stream);
+    void restoreState (BinaryInputStream &stream);
 };
 
+// Median Trackvis writer: in append mode, successive medians are added to the end of the file.
+// Streamlines may arrive over any number of blocks. Lengths are kept as
+// histograms, and coordinates as one column per position along either side
+// of the seed; columns are spilled to a temporary file when they exceed the
+// memory limit. In approximate mode each coordinate column is replaced by a
+// fixed-size histogram spanning the grid, so memory use doesn't depend on the
+// number of streamlines at all, and each coordinate of the median is within
+// half a bin of the exact value
 class MedianTrackvisDataSink : public TrackvisDataSink
 {
 protected:
+    static const int sketchBins = 1024;
+    
     double quantile;
-    Streamline median;
+    bool approximate;
+    size_t memoryLimit;
+    
+    size_t nReceived;
+    Streamline::PointType pointType;
+    
+    // Indexed by side (left or right), then by length or position
+    std::vector<size_t> lengthCounts[2];
+    std::vector< std::vector<float> > columns[2];
+    std::vector<QuantileHistogram> sketches[2];
+    size_t columnBytes;
+    
+    // Spilled columns are stored as segments of the temporary file
+    struct Segment
+    {
+        uint64_t offset;
+        size_t count;
+    };
+    std::string spillPath;
+    std::fstream spillStream;
+    uint64_t spillPosition;
+    std::vector< std::vector<Segment> > segments[2];
+    
+    void spill ();
+    int lengthQuantile (const int side) const;
+    Space<3>::Point medianPoint (const int side, const int position);
     
 public:
-    MedianTrackvisDataSink (const std::string &fileStem, const Grid<3> &grid, const double quantile = 0.99)
-        : TrackvisDataSink(fileStem,grid), quantile(quantile) {}
+    MedianTrackvisDataSink (const std::string &fileStem, const Grid<3> &grid, const double quantile = 0.99, const bool append = false)
+        : TrackvisDataSink(fileStem,grid,append), quantile(quantile), approximate(false), memoryLimit(268435456), nReceived(0), columnBytes(0), spillPosition(0) {}
+    
+    ~MedianTrackvisDataSink ()
+    {
+        if (spillStream.is_open())
+        {
+            spillStream.close();
+            std::remove(spillPath.c_str());
+        }
+    }
+    
+    void setApproximate (const bool value) { approximate = value; }
+    void setMemoryLimit (const size_t bytes) { memoryLimit = bytes; }
     
     void setup (const size_type &count, const_iterator begin, const_iterator end);
     void done ();
+    
+    // The median depends on every streamline at once, so there is no intermediate state to save
+    void saveState (BinaryOutputStream &) { throw std::runtime_error("Median streamline output cannot be checkpointed"); }
+    void restoreState (BinaryInputStream &) { throw std::runtime_error("Median streamline output cannot be checkpointed"); }
 };
 
 #endif
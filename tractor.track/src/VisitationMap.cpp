@@ -4,6 +4,13 @@
 #include "Streamline.h"
 #include "VisitationMap.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// The most memory that per-thread dense shards may use between them (1 GiB)
+static const size_t maxShardBytes = 1073741824;
+
 struct divider
 {
     double divisor;
@@ -14,74 +21,426 @@ struct divider
     double operator() (double x) { return x/divisor; }
 };
 
-inline void checkAndSetPoint (Array<bool> &visited, Array<double> &values, const Space<3>::Point &point)
+void VisitationMapDataSink::addPoint (const Space<3>::Point &point, std::vector<size_t> &voxels) const
 {
-    static std::vector<int> loc(3);
-    size_t index;
-    
+    int loc[3];
     for (int i=0; i<3; i++)
-        loc[i] = static_cast<int>(round(point[i]));
-    
-    values.flattenIndex(loc, index);
-    if (!visited[index])
     {
-        visited[index] = true;
-        values[index] += 1.0;
+        loc[i] = static_cast<int>(round(point[i]));
+        if (loc[i] < 0 || loc[i] >= dims[i])
+            return;
     }
+    
+    // Successive points often fall in the same voxel, so skip those straight away
+    const size_t index = loc[0] + dims[0] * (loc[1] + static_cast<size_t>(dims[1]) * loc[2]);
+    if (voxels.empty() || voxels.back() != index)
+        voxels.push_back(index);
 }
 
-void VisitationMapDataSink::setup (const size_type &count, const_iterator begin, const_iterator end)
-{
-    totalStreamlines += count;
-}
-
-void VisitationMapDataSink::put (const Streamline &data)
+// The voxels are sorted and made unique in each case, so each is only counted once
+void VisitationMapDataSink::collectVoxels (const Streamline &data, std::vector<size_t> &voxels) const
 {
-    Array<bool> visited(values.getDimensions(), false);
-    
     const std::vector<Space<3>::Point> &leftPoints = data.getLeftPoints();
     const std::vector<Space<3>::Point> &rightPoints = data.getRightPoints();
     
+    voxels.clear();
     switch (scope)
     {
         case FullMappingScope:
         for (size_t i=0; i<leftPoints.size(); i++)
-            checkAndSetPoint(visited, values, leftPoints[i]);
+            addPoint(leftPoints[i], voxels);
         for (size_t i=0; i<rightPoints.size(); i++)
-            checkAndSetPoint(visited, values, rightPoints[i]);
+            addPoint(rightPoints[i], voxels);
         break;
         
         case SeedMappingScope:
         if (leftPoints.size() > 0)
-            checkAndSetPoint(visited, values, leftPoints[0]);
+            addPoint(leftPoints[0], voxels);
         else if (rightPoints.size() > 0)
-            checkAndSetPoint(visited, values, rightPoints[0]);
+            addPoint(rightPoints[0], voxels);
         break;
         
         case EndsMappingScope:
         if (leftPoints.size() > 0)
         {
             size_t i = leftPoints.size() - 1;
-            checkAndSetPoint(visited, values, leftPoints[i]);
+            addPoint(leftPoints[i], voxels);
         }
         if (rightPoints.size() > 0)
         {
             size_t i = rightPoints.size() - 1;
-            checkAndSetPoint(visited, values, rightPoints[i]);
+            addPoint(rightPoints[i], voxels);
         }
         break;
     }
+    
+    std::sort(voxels.begin(), voxels.end());
+    voxels.erase(std::unique(voxels.begin(), voxels.end()), voxels.end());
+}
+
+void VisitationMapDataSink::collectVoxels (const StreamlinePointView &data, std::vector<size_t> &voxels) const
+{
+    voxels.clear();
+    const size_t nPoints = data.size();
+    if (nPoints == 0)
+        return;
+    
+    const int seed = data.getSeedIndex();
+    if (seed < 0 || static_cast<size_t>(seed) >= nPoints)
+        throw std::runtime_error("Streamline seed index is out of range");
+    
+    // Points are stored in order, so the left end comes first and the right end last
+    switch (scope)
+    {
+        case FullMappingScope:
+        for (size_t i=0; i<nPoints; i++)
+            addPoint(data[i], voxels);
+        break;
+        
+        case SeedMappingScope:
+        addPoint(data[seed], voxels);
+        break;
+        
+        case EndsMappingScope:
+        addPoint(data[0], voxels);
+        addPoint(data[nPoints-1], voxels);
+        break;
+    }
+    
+    std::sort(voxels.begin(), voxels.end());
+    voxels.erase(std::unique(voxels.begin(), voxels.end()), voxels.end());
+}
+
+void VisitationMapDataSink::addVoxels (const std::vector<size_t> &voxels)
+{
+    if (sparse)
+    {
+        pending.insert(pending.end(), voxels.begin(), voxels.end());
+        
+        // Merging costs time proportional to the entries already stored, so
+        // letting the pending list grow as large keeps the cost amortised
+        if (pending.size() >= std::max(size_t(65536), sparseIndices.size()))
+            mergePending();
+    }
+    else
+    {
+        for (std::vector<size_t>::const_iterator it=voxels.begin(); it!=voxels.end(); it++)
+            values[*it] += 1.0;
+    }
+}
+
+void VisitationMapDataSink::mergePending ()
+{
+    if (!sparse || pending.empty())
+        return;
+    
+    std::sort(pending.begin(), pending.end());
+    
+    std::vector<size_t> indices;
+    std::vector<double> counts;
+    indices.reserve(sparseIndices.size() + pending.size());
+    counts.reserve(sparseIndices.size() + pending.size());
+    
+    // Walk the existing runs and the new visits together, in voxel order
+    size_t i = 0, j = 0;
+    while (i < sparseIndices.size() || j < pending.size())
+    {
+        size_t index;
+        double count = 0.0;
+        if (j == pending.size() || (i < sparseIndices.size() && sparseIndices[i] <= pending[j]))
+            index = sparseIndices[i];
+        else
+            index = pending[j];
+        
+        if (i < sparseIndices.size() && sparseIndices[i] == index)
+            count += sparseValues[i++];
+        while (j < pending.size() && pending[j] == index)
+        {
+            count += 1.0;
+            j++;
+        }
+        
+        indices.push_back(index);
+        counts.push_back(count);
+    }
+    
+    sparseIndices.swap(indices);
+    sparseValues.swap(counts);
+    std::vector<size_t>().swap(pending);
+    
+    // Each sparse entry takes twice the space of a dense one, so switch over
+    // well before the break-even point
+    if (sparseIndices.size() > nVoxels / 4)
+        densify();
+}
+
+void VisitationMapDataSink::densify ()
+{
+    if (!sparse)
+        return;
+    
+    values = Array<double>(dims, 0.0);
+    for (size_t i=0; i<sparseIndices.size(); i++)
+        values[sparseIndices[i]] = sparseValues[i];
+    for (std::vector<size_t>::const_iterator it=pending.begin(); it!=pending.end(); it++)
+        values[*it] += 1.0;
+    
+    std::vector<size_t>().swap(pending);
+    std::vector<size_t>().swap(sparseIndices);
+    std::vector<double>().swap(sparseValues);
+    sparse = false;
+}
+
+void VisitationMapDataSink::reduce ()
+{
+    for (size_t j=0; j<shards.size(); j++)
+    {
+        if (shards[j].empty())
+            continue;
+        
+        const std::vector<uint32_t> &shard = shards[j];
+        #pragma omp parallel for num_threads(nThreads) schedule(static)
+        for (long i=0; i<static_cast<long>(shard.size()); i++)
+            values[i] += shard[i];
+        
+        // Release the memory, not just the contents
+        std::vector<uint32_t>().swap(shards[j]);
+    }
+}
+
+void VisitationMapDataSink::setup (const size_type &count, const_iterator begin, const_iterator end)
+{
+    totalStreamlines += count;
+    
+    // Small blocks aren't worth distributing, so they are mapped by put() as usual
+    blockMapped = (nThreads > 1 && count > 1);
+    if (!blockMapped)
+        return;
+    
+    std::vector<const Streamline *> elements;
+    for (const_iterator it=begin; it!=end; it++)
+        elements.push_back(&(*it));
+    
+    // Full-size shards for every thread could take more memory than the map
+    // itself many times over, so above a limit a dense map is also updated
+    // from lists of visits
+    const bool sharded = (!sparse && nVoxels * nThreads * sizeof(uint32_t) <= maxShardBytes);
+    if (sharded && shards.size() < static_cast<size_t>(nThreads))
+        shards.resize(nThreads);
+    std::string errorMessage;
+    
+    // While the map is sparse, each thread gathers its visits into a list,
+    // and the lists are appended to the pending visits; the order doesn't
+    // matter because they are sorted when merged. Otherwise threads count
+    // into their own full-size shards, or add their lists to the map in turn
+    #pragma omp parallel num_threads(nThreads)
+    {
+        std::vector<uint32_t> *shard = NULL;
+        if (sharded)
+        {
+#ifdef _OPENMP
+            shard = &shards[omp_get_thread_num()];
+#else
+            shard = &shards[0];
+#endif
+            if (shard->empty())
+                shard->resize(values.size(), 0);
+        }
+        std::vector<size_t> threadVoxels, threadVisits;
+        
+        #pragma omp for schedule(dynamic,64)
+        for (long j=0; j<static_cast<long>(elements.size()); j++)
+        {
+            // Exceptions can't propagate out of the parallel region
+            try
+            {
+                collectVoxels(*elements[j], threadVoxels);
+                if (!sharded)
+                    threadVisits.insert(threadVisits.end(), threadVoxels.begin(), threadVoxels.end());
+                else
+                {
+                    for (std::vector<size_t>::const_iterator it=threadVoxels.begin(); it!=threadVoxels.end(); it++)
+                        (*shard)[*it]++;
+                }
+            }
+            catch (std::exception &e)
+            {
+                #pragma omp critical
+                errorMessage = e.what();
+            }
+        }
+        
+        if (sparse)
+        {
+            #pragma omp critical
+            pending.insert(pending.end(), threadVisits.begin(), threadVisits.end());
+        }
+        else if (!sharded)
+        {
+            #pragma omp critical
+            for (std::vector<size_t>::const_iterator it=threadVisits.begin(); it!=threadVisits.end(); it++)
+                values[*it] += 1.0;
+        }
+    }
+    
+    if (!errorMessage.empty())
+        throw std::runtime_error(errorMessage);
+    
+    if (sparse && pending.size() >= std::max(size_t(65536), sparseIndices.size()))
+        mergePending();
+}
+
+void VisitationMapDataSink::put (const Streamline &data)
+{
+    // The block has already been dealt with in parallel
+    if (blockMapped)
+        return;
+    
+    collectVoxels(data, voxels);
+    addVoxels(voxels);
+}
+
+void VisitationMapDataSink::put (const StreamlinePointView &data)
+{
+    totalStreamlines++;
+    collectVoxels(data, voxels);
+    addVoxels(voxels);
+}
+
+// The state is always stored densely, so checkpoints don't depend on the
+// representation in use when they were written
+void VisitationMapDataSink::saveState (BinaryOutputStream &stream)
+{
+    reduce();
+    mergePending();
+    stream.writeValue<uint64_t>(totalStreamlines);
+    stream.writeValue<uint64_t>(nVoxels);
+    if (sparse)
+    {
+        size_t next = 0;
+        for (size_t i=0; i<sparseIndices.size(); i++)
+        {
+            stream.writeValues<double>(0.0, sparseIndices[i] - next);
+            stream.writeValue<double>(sparseValues[i]);
+            next = sparseIndices[i] + 1;
+        }
+        stream.writeValues<double>(0.0, nVoxels - next);
+    }
+    else
+    {
+        for (Array<double>::const_iterator it=values.begin(); it!=values.end(); it++)
+            stream.writeValue<double>(*it);
+    }
+}
+
+void VisitationMapDataSink::restoreState (BinaryInputStream &stream)
+{
+    shards.clear();
+    totalStreamlines = stream.readValue<uint64_t>();
+    if (stream.readValue<uint64_t>() != nVoxels)
+        throw std::runtime_error("Checkpointed visitation map does not match the current image dimensions");
+    
+    sparse = true;
+    values = Array<double>();
+    std::vector<size_t>().swap(pending);
+    sparseIndices.clear();
+    sparseValues.clear();
+    for (size_t i=0; i<nVoxels; i++)
+    {
+        const double value = stream.readValue<double>();
+        if (!sparse)
+            values[i] = value;
+        else if (value != 0.0)
+        {
+            sparseIndices.push_back(i);
+            sparseValues.push_back(value);
+            if (sparseIndices.size() > nVoxels / 4)
+                densify();
+        }
+    }
 }
 
 void VisitationMapDataSink::done ()
 {
+    reduce();
+    mergePending();
     if (normalise)
-        std::transform(values.begin(), values.end(), values.begin(), divider(static_cast<double>(totalStreamlines)));
+    {
+        const divider divide(static_cast<double>(totalStreamlines));
+        if (sparse)
+            std::transform(sparseValues.begin(), sparseValues.end(), sparseValues.begin(), divide);
+        else
+            std::transform(values.begin(), values.end(), values.begin(), divide);
+    }
 }
 
-void VisitationMapDataSink::writeToNifti (const RNifti::NiftiImage &reference, const std::string &fileName) const
+void VisitationMapDataSink::writeToNifti (const RNifti::NiftiImage &reference, const std::string &fileName, const int datatype) const
 {
+    if (datatype != DT_FLOAT64 && datatype != DT_FLOAT32 && datatype != DT_UINT32)
+        throw std::runtime_error("Visitation maps can only be written as 64-bit or 32-bit floating-point or 32-bit unsigned integer images");
+    else if (datatype == DT_UINT32 && normalise)
+        throw std::runtime_error("Normalised visitation maps can't be written with an integer datatype");
+    
     RNifti::NiftiImage image = reference;
-    image.replaceData(values.getData(), DT_FLOAT64);
+    if (sparse)
+    {
+        std::vector<double> data(nVoxels, 0.0);
+        for (size_t i=0; i<sparseIndices.size(); i++)
+            data[sparseIndices[i]] = sparseValues[i];
+        image.replaceData(data, datatype);
+    }
+    else
+        image.replaceData(values.getData(), datatype);
     image.toFile(fileName);
 }
+
+// Sparse map format: magic number "VISITMAP", int32 version (1), int32 number
+// of dimensions (3), int32 dimensions, int32 number of nonzero voxels, then
+// their int32 coordinates (1-based, all x then all y then all z) and float64
+// values, in voxel order. Values are stored in native byte order
+void VisitationMapDataSink::writeSparse (const std::string &fileName) const
+{
+    std::vector<size_t> indices;
+    std::vector<double> counts;
+    if (sparse)
+    {
+        indices = sparseIndices;
+        counts = sparseValues;
+    }
+    else
+    {
+        for (size_t i=0; i<values.size(); i++)
+        {
+            if (values[i] != 0.0)
+            {
+                indices.push_back(i);
+                counts.push_back(values[i]);
+            }
+        }
+    }
+    
+    // R can't index vectors of more elements than this with integers
+    if (indices.size() > 2147483647)
+        throw std::runtime_error("Too many nonzero voxels to write a sparse map");
+    
+    std::ofstream fileStream(fileName.c_str(), std::ios::binary);
+    if (!fileStream)
+        throw std::runtime_error("Can't open sparse map file " + fileName + " for writing");
+    BinaryOutputStream stream(&fileStream);
+    
+    fileStream.write("VISITMAP", 8);
+    stream.writeValue<int32_t>(1);
+    stream.writeValue<int32_t>(3);
+    for (int j=0; j<3; j++)
+        stream.writeValue<int32_t>(dims[j]);
+    stream.writeValue<int32_t>(static_cast<int32_t>(indices.size()));
+    
+    size_t stride = 1;
+    for (int j=0; j<3; j++)
+    {
+        for (size_t i=0; i<indices.size(); i++)
+            stream.writeValue<int32_t>(static_cast<int32_t>((indices[i] / stride) % dims[j] + 1));
+        stride *= dims[j];
+    }
+    stream.writeVector<double>(counts);
+}
@@ -4,34 +4,94 @@
 #include "DataSource.h"
 #include "Streamline.h"
 #include "Array.h"
+#include "Checkpoint.h"
+#include "Trackvis.h"
 
-class VisitationMapDataSink : public DataSink<Streamline>
+// Visitation map: counts the streamlines passing through each voxel, or
+// starting or ending in it. With several threads, each block is mapped in
+// parallel when it arrives, with each thread counting into its own shard of
+// the map; shards are summed into the map at the end. If the shards would
+// take too much memory, threads instead add lists of visits to the map one
+// at a time. Counts are integers, so the result doesn't depend on how the
+// work was divided up. Small tracts visit a tiny fraction of the volume, so
+// counts are first kept sparsely, as sorted voxel indices and values, and
+// only expanded to a full array when that would take less memory
+class VisitationMapDataSink : public DataSink<Streamline>, public Checkpointable
 {
 public:
     enum MappingScope { FullMappingScope, SeedMappingScope, EndsMappingScope };
     
 private:
+    std::vector<int> dims;
+    size_t nVoxels;
     Array<double> values;
     MappingScope scope;
     bool normalise;
     size_t totalStreamlines;
     
+    // Flat indices of the voxels visited by the current streamline, so that
+    // each is counted once; the buffer is reused to avoid allocation
+    std::vector<size_t> voxels;
+    
+    // Sparse representation: visits not yet merged are appended to the
+    // pending list, which is sorted and merged into the runs periodically
+    bool sparse;
+    std::vector<size_t> pending;
+    std::vector<size_t> sparseIndices;
+    std::vector<double> sparseValues;
+    
+    int nThreads;
+    bool blockMapped;
+    std::vector< std::vector<uint32_t> > shards;
+    
+    void addPoint (const Space<3>::Point &point, std::vector<size_t> &voxels) const;
+    void collectVoxels (const Streamline &data, std::vector<size_t> &voxels) const;
+    void collectVoxels (const StreamlinePointView &data, std::vector<size_t> &voxels) const;
+    void addVoxels (const std::vector<size_t> &voxels);
+    void mergePending ();
+    void densify ();
+    void reduce ();
+    
     // Hide default constructor
     VisitationMapDataSink () {}
     
 public:
     VisitationMapDataSink (const std::vector<int> &dims, const MappingScope scope = FullMappingScope, const bool normalise = false)
-        : scope(scope), normalise(normalise), totalStreamlines(0)
+        : dims(dims), scope(scope), normalise(normalise), totalStreamlines(0), sparse(true), nThreads(1), blockMapped(false)
     {
-        values = Array<double>(dims, 0.0);
+        nVoxels = 1;
+        for (size_t i=0; i<dims.size(); i++)
+            nVoxels *= dims[i];
     }
     
+    void setThreads (const int nThreads) { this->nThreads = std::max(nThreads, 1); }
+    
     void setup (const size_type &count, const_iterator begin, const_iterator end);
     void put (const Streamline &data);
     void done ();
     
-    const Array<double> & getArray () const { return values; }
-    void writeToNifti (const RNifti::NiftiImage &reference, const std::string &fileName) const;
+    // Map a streamline directly from its stored points; this bypasses the
+    // pipeline, so the streamline is also counted here
+    void put (const StreamlinePointView &data);
+    
+    void saveState (BinaryOutputStream &stream);
+    void restoreState (BinaryInputStream &stream);
+    
+    bool isSparse () const { return sparse; }
+    
+    // The full array is created if necessary
+    const Array<double> & getArray ()
+    {
+        if (sparse)
+            densify();
+        return values;
+    }
+    
+    // The datatype may be DT_FLOAT64, DT_FLOAT32 or (for unnormalised maps) DT_UINT32
+    void writeToNifti (const RNifti::NiftiImage &reference, const std::string &fileName, const int datatype = DT_FLOAT64) const;
+    
+    // Write only the nonzero voxels, as 1-based coordinates and values
+    void writeSparse (const std::string &fileName) const;
 };
 
 #endif
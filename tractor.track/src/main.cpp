@@ -1,4 +1,5 @@
 #include <RcppEigen.h>
+#include <chrono>
 
 #include "Space.h"
 #include "RNifti.h"
@@ -8,8 +9,13 @@
 #include "Filter.h"
 #include "Trackvis.h"
 #include "VisitationMap.h"
+#include "Connectome.h"
+#include "Sampling.h"
 #include "RCallback.h"
 #include "Pipeline.h"
+#include "Checkpoint.h"
+#include "TrackingJob.h"
+#include "TrackingServer.h"
 
 using namespace Rcpp;
 
@@ -49,7 +55,7 @@ FinalType increment (OriginalType x)
     return static_cast<FinalType>(x + OriginalType(1));
 }
 
-RcppExport SEXP track (SEXP _model, SEXP _seeds, SEXP _count, SEXP _maskPath, SEXP _targetInfo, SEXP _rightwardsVector, SEXP _maxSteps, SEXP _stepLength, SEXP _curvatureThreshold, SEXP _useLoopcheck, SEXP _oneWay, SEXP _terminateAtTargets, SEXP _minTargetHits, SEXP _minLength, SEXP _maxLength, SEXP _jitter, SEXP _mapPath, SEXP _trkPath, SEXP _medianPath, SEXP _profileFunction, SEXP _debugLevel)
+RcppExport SEXP track (SEXP _model, SEXP _seeds, SEXP _count, SEXP _maskPath, SEXP _targetInfo, SEXP _rightwardsVector, SEXP _maxSteps, SEXP _stepLength, SEXP _curvatureThreshold, SEXP _useLoopcheck, SEXP _oneWay, SEXP _terminateAtTargets, SEXP _minTargetHits, SEXP _minLength, SEXP _maxLength, SEXP _jitter, SEXP _convergence, SEXP _mapPath, SEXP _trkPath, SEXP _trkTolerance, SEXP _medianPath, SEXP _medianQuantile, SEXP _connectome, SEXP _profileFunction, SEXP _seedProfiles, SEXP _seedwise, SEXP _threads, SEXP _checkpointPath, SEXP _checkpointInterval, SEXP _checkpointLimit, SEXP _resume, SEXP _debugLevel)
 {
 BEGIN_RCPP
     XPtr<DiffusionModel> modelPtr(_model);
@@ -58,28 +64,24 @@ BEGIN_RCPP
     const std::string gridOrientation = grid3DOrientation(grid);
     
     Tracker tracker(model);
+    TrackingJob job;
     
     RNifti::NiftiImage mask(as<std::string>(_maskPath));
     mask.reorient(gridOrientation);
     tracker.setMask(mask);
     tracker.setDebugLevel(as<int>(_debugLevel));
     
-    std::map<std::string,bool> flags;
-    flags["loopcheck"] = as<bool>(_useLoopcheck);
-    flags["one-way"] = as<bool>(_oneWay);
-    flags["terminate-targets"] = as<bool>(_terminateAtTargets);
-    tracker.setFlags(flags);
+    job.flags["loopcheck"] = as<bool>(_useLoopcheck);
+    job.flags["one-way"] = as<bool>(_oneWay);
+    job.flags["terminate-targets"] = as<bool>(_terminateAtTargets);
     
-    Space<3>::Vector rightwardsVector;
-    if (Rf_isNull(_rightwardsVector))
-        rightwardsVector = Space<3>::zeroVector();
-    else
-        rightwardsVector = as<Eigen::VectorXf>(_rightwardsVector);
-    tracker.setRightwardsVector(rightwardsVector);
+    if (!Rf_isNull(_rightwardsVector))
+        job.rightwardsVector = as<Eigen::VectorXf>(_rightwardsVector);
     
-    tracker.setInnerProductThreshold(as<float>(_curvatureThreshold));
-    tracker.setStepLength(as<float>(_stepLength));
-    tracker.setMaxSteps(as<int>(_maxSteps));
+    job.curvatureThreshold = as<float>(_curvatureThreshold);
+    job.stepLength = as<float>(_stepLength);
+    job.maxSteps = as<int>(_maxSteps);
+    job.configure(tracker);
     
     List targetInfo(_targetInfo);
     if (!Rf_isNull(targetInfo["path"]))
@@ -88,83 +90,126 @@ BEGIN_RCPP
         tracker.setTargets(targets.reorient(gridOrientation));
     }
     
+    if (!Rf_isNull(targetInfo["indices"]) && !Rf_isNull(targetInfo["labels"]))
+    {
+        IntegerVector indices = targetInfo["indices"];
+        CharacterVector labels = targetInfo["labels"];
+        for (int i=0; i<std::min(indices.size(),labels.size()); i++)
+            job.labelDictionary[indices[i]] = labels[i];
+    }
+    
     RNGScope scope;
     
     NumericMatrix seedsR(_seeds);
-    Eigen::MatrixXf seeds(seedsR.rows(), seedsR.cols());
-    std::transform(seedsR.begin(), seedsR.end(), seeds.data(), decrement<double,float>);
-    TractographyDataSource dataSource(&tracker, seeds.array(), as<size_t>(_count), as<bool>(_jitter));
-    Pipeline<Streamline> pipeline(&dataSource);
-    
-    const int minTargetHits = as<int>(_minTargetHits);
-    if (minTargetHits > 0)
-        pipeline.addManipulator(new LabelCountFilter(minTargetHits));
-    
-    const double minLength = as<double>(_minLength);
-    double maxLength = as<double>(_maxLength);
-    maxLength = (maxLength == R_PosInf ? 0.0 : maxLength);
-    if (minLength > 0.0 || maxLength > 0.0)
-        pipeline.addManipulator(new LengthFilter(minLength, maxLength));
-    
-    VisitationMapDataSink *visitationMap = NULL;
-    Rcpp::Function *function = NULL;
-    if (!Rf_isNull(_mapPath))
+    job.seeds.resize(seedsR.rows(), 3);
+    std::transform(seedsR.begin(), seedsR.end(), job.seeds.data(), decrement<double,float>);
+    
+    job.count = as<size_t>(_count);
+    job.jitter = as<bool>(_jitter);
+    job.seedwise = as<bool>(_seedwise);
+    job.threads = as<int>(_threads);
+    job.minTargetHits = as<int>(_minTargetHits);
+    job.minLength = as<double>(_minLength);
+    const double maxLength = as<double>(_maxLength);
+    job.maxLength = (maxLength == R_PosInf ? 0.0 : maxLength);
+    
+    // Convergence settings for adaptive streamline counts, if required
+    if (!Rf_isNull(_convergence))
     {
-        visitationMap = new VisitationMapDataSink(mask.dim());
-        pipeline.addSink(visitationMap);
+        List convergence(_convergence);
+        job.tolerance = as<double>(convergence["tolerance"]);
+        job.minCount = as<size_t>(convergence["minCount"]);
+        job.batchSize = as<size_t>(convergence["batchSize"]);
+        if (as<std::string>(convergence["measure"]) == "profile")
+            job.measure = TractographyDataSource::ProfileConvergence;
     }
+    
+    if (!Rf_isNull(_mapPath))
+        job.mapPaths = as<str_vector>(_mapPath);
     if (!Rf_isNull(_trkPath))
-    {
-        TrackvisDataSink *trkFile;
-        
-        if (!Rf_isNull(targetInfo["indices"]) && !Rf_isNull(targetInfo["labels"]))
-        {
-            IntegerVector indices = targetInfo["indices"];
-            CharacterVector labels = targetInfo["labels"];
-            std::map<int,std::string> labelDictionary;
-            for (int i=0; i<std::min(indices.size(),labels.size()); i++)
-                labelDictionary[indices[i]] = labels[i];
-            trkFile = new LabelledTrackvisDataSink(as<std::string>(_trkPath), grid, labelDictionary);
-        }
-        else
-            trkFile = new BasicTrackvisDataSink(as<std::string>(_trkPath), grid);
-        
-        pipeline.addSink(trkFile);
-    }
+        job.trkPath = as<std::string>(_trkPath);
+    job.trkTolerance = as<double>(_trkTolerance);
     if (!Rf_isNull(_medianPath))
+        job.medianPath = as<std::string>(_medianPath);
+    job.medianQuantile = as<double>(_medianQuantile);
+    
+    // Connectome settings, if required; the targets are the parcellation
+    if (!Rf_isNull(_connectome))
     {
-        pipeline.addSink(new MedianTrackvisDataSink(as<std::string>(_medianPath), grid));
-        
-        // Pipeline must contain all streamlines at once for calculating median
-        pipeline.setBlockSize(as<size_t>(_count));
+        List connectome(_connectome);
+        job.connectomePath = as<std::string>(connectome["path"]);
+        if (as<std::string>(connectome["edges"]) == "traversal")
+            job.connectomeEdges = ConnectomeDataSink::TraversalEdges;
+        if (!Rf_isNull(connectome["scalarPath"]))
+            job.connectomeScalarPath = as<std::string>(connectome["scalarPath"]);
     }
-    if (!Rf_isNull(_profileFunction))
+    job.requireProfile = !Rf_isNull(_profileFunction);
+    job.seedProfiles = as<bool>(_seedProfiles);
+    
+    if (!Rf_isNull(_checkpointPath))
     {
-        function = new Rcpp::Function(_profileFunction);
-        pipeline.addSink(new ProfileMatrixDataSink(*function));
+        job.checkpointPath = as<std::string>(_checkpointPath);
+        job.checkpointInterval = as<size_t>(_checkpointInterval);
+        job.checkpointLimit = as<size_t>(_checkpointLimit);
+        job.resume = as<bool>(_resume);
     }
     
-    size_t nRetained = pipeline.run();
-    
-    if (visitationMap != NULL)
-        visitationMap->writeToNifti(mask, as<std::string>(_mapPath));
+    job.run(tracker, mask);
     
-    delete function;
+    // Profiles are passed back to R once per seed group, or once per seed if requested
+    if (job.requireProfile)
+    {
+        Function function(_profileFunction);
+        for (size_t i=0; i<job.profiles.size(); i++)
+        {
+            std::vector<int> labels;
+            std::vector<size_t> labelCounts;
+            for (std::map<int,size_t>::const_iterator it=job.profiles[i].begin(); it!=job.profiles[i].end(); it++)
+            {
+                labels.push_back(it->first);
+                labelCounts.push_back(it->second);
+            }
+            function(wrap(labels), wrap(labelCounts));
+        }
+    }
     
-    return wrap(nRetained);
+    return List::create(Named("retained")=job.retained, Named("generated")=job.generated);
 END_RCPP
 }
 
-RcppExport SEXP trkApply (SEXP _trkPath, SEXP _indices, SEXP _function)
+RcppExport SEXP runTrackingServer (SEXP _socketPath, SEXP _threads)
 {
 BEGIN_RCPP
-    BasicTrackvisDataSource trkFile(as<std::string>(_trkPath));
-    Pipeline<Streamline> pipeline(&trkFile);
+    TrackingServer server(as<std::string>(_socketPath), as<int>(_threads));
+    server.run();
+    return R_NilValue;
+END_RCPP
+}
+
+RcppExport SEXP submitTrackingRequest (SEXP _socketPath, SEXP _request)
+{
+BEGIN_RCPP
+    return wrap(sendTrackingRequest(as<std::string>(_socketPath), as<std::string>(_request)));
+END_RCPP
+}
+
+RcppExport SEXP trkApply (SEXP _trkPath, SEXP _indices, SEXP _function, SEXP _batchSize, SEXP _threads)
+{
+BEGIN_RCPP
+    // A nonzero batch size means the function is called once per block
+    const int batchSize = as<int>(_batchSize);
+    MappedTrackvisDataSource trkFile(as<std::string>(_trkPath));
+    trkFile.setThreads(as<int>(_threads));
+    Pipeline<Streamline> pipeline(&trkFile, batchSize > 0 ? batchSize : 1000);
+    pipeline.setThreads(as<int>(_threads));
     int_vector indices = as<int_vector>(_indices);
     std::transform(indices.begin(), indices.end(), indices.begin(), decrement<int,int>);
     pipeline.setSubset(indices);
     Function function(_function);
-    pipeline.addSink(new RCallbackDataSink(function));
+    if (batchSize > 0)
+        pipeline.addSink(new BatchedRCallbackDataSink(function));
+    else
+        pipeline.addSink(new RCallbackDataSink(function));
     
     pipeline.run();
     
@@ -180,70 +225,87 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP trkFastMapAndLengths (SEXP _trkPath, SEXP _indices, SEXP _pointer)
+RcppExport SEXP trkFastMapAndLengths (SEXP _trkPath, SEXP _indices)
 {
 BEGIN_RCPP
-    StreamlineLabelList *labelList = NULL;
-    if (!Rf_isNull(_pointer))
-    {
-        XPtr<StreamlineLabelList> labelsPtr(_pointer);
-        labelList = labelsPtr;
-    }
-    
-    // A labelled source is used for speed, since it stores the streamline offsets for seeking
-    LabelledTrackvisDataSource trkFile(as<std::string>(_trkPath), labelList);
-    Pipeline<Streamline> pipeline(&trkFile);
+    // Streamlines are mapped and measured directly from their stored points,
+    // and the offset index is used for seeking, so the label list pointer is
+    // no longer needed
+    MappedTrackvisDataSource trkFile(as<std::string>(_trkPath));
     int_vector indices = as<int_vector>(_indices);
     std::transform(indices.begin(), indices.end(), indices.begin(), decrement<int,int>);
-    pipeline.setSubset(indices);
+    std::sort(indices.begin(), indices.end());
     
     int_vector dims(3);
     const Grid<3> &grid = trkFile.getGrid3D();
     std::copy(grid.dimensions().data(), grid.dimensions().data()+3, dims.begin());
-    VisitationMapDataSink *map = new VisitationMapDataSink(dims);
-    pipeline.addSink(map);
-    
-    StreamlineLengthsDataSink *lengths = new StreamlineLengthsDataSink;
-    pipeline.addSink(lengths);
+    VisitationMapDataSink map(dims);
     
-    pipeline.run();
+    const size_t n = (indices.empty() ? trkFile.nStreamlines() : indices.size());
+    std::vector<double> lengths(n);
+    StreamlinePointView view;
+    for (size_t i=0; i<n; i++)
+    {
+        if (!indices.empty())
+        {
+            if (indices[i] < 0 || static_cast<size_t>(indices[i]) >= trkFile.nStreamlines())
+                throw std::runtime_error("Streamline index is out of range");
+            trkFile.seek(indices[i]);
+        }
+        trkFile.getView(view);
+        map.put(view);
+        lengths[i] = view.getLength();
+    }
     
-    const Array<double> &array = map->getArray();
+    const Array<double> &array = map.getArray();
     NumericVector arrayR = wrap(array.getData());
     arrayR.attr("dim") = array.getDimensions();
-    List result = List::create(Named("map")=arrayR, Named("lengths")=lengths->getLengths());
+    List result = List::create(Named("map")=arrayR, Named("lengths")=lengths);
     return result;
 END_RCPP
 }
 
-RcppExport SEXP trkFind (SEXP _trkPath, SEXP _labels, SEXP _pointer)
+RcppExport SEXP trkFind (SEXP _trkPath, SEXP _labels, SEXP _anyLabels, SEXP _noneLabels, SEXP _pointer)
 {
 BEGIN_RCPP
     std::vector<int> indices;
     if (Rf_isNull(_pointer))
     {
         StreamlineLabelList labelList(as<std::string>(_trkPath));
-        indices = labelList.find(as<int_vector>(_labels));
+        indices = labelList.find(as<int_vector>(_labels), as<int_vector>(_anyLabels), as<int_vector>(_noneLabels));
     }
     else
     {
         XPtr<StreamlineLabelList> labelsPtr(_pointer);
         StreamlineLabelList *labelList = labelsPtr;
-        indices = labelList->find(as<int_vector>(_labels));
+        indices = labelList->find(as<int_vector>(_labels), as<int_vector>(_anyLabels), as<int_vector>(_noneLabels));
     }
     std::transform(indices.begin(), indices.end(), indices.begin(), increment<int,int>);
     return wrap(indices);
 END_RCPP
 }
 
+RcppExport SEXP trkFindCount (SEXP _labels, SEXP _anyLabels, SEXP _noneLabels, SEXP _pointer)
+{
+BEGIN_RCPP
+    XPtr<StreamlineLabelList> labelsPtr(_pointer);
+    return wrap(labelsPtr->count(as<int_vector>(_labels), as<int_vector>(_anyLabels), as<int_vector>(_noneLabels)));
+END_RCPP
+}
+
+RcppExport SEXP trkCoOccurrence (SEXP _labels, SEXP _pointer)
+{
+BEGIN_RCPP
+    XPtr<StreamlineLabelList> labelsPtr(_pointer);
+    return wrap(labelsPtr->coOccurrence(as<int_vector>(_labels)));
+END_RCPP
+}
+
 RcppExport SEXP trkInfo (SEXP _trkPath)
 {
 BEGIN_RCPP
     BasicTrackvisDataSource trkFile(as<std::string>(_trkPath));
-    std::vector<std::string> properties = trkFile.getPropertyNames();
-    if (properties.size() == 0)
-        properties.push_back("(none)");
-    return wrap(properties);
+    return List::create(Named("properties")=trkFile.getPropertyNames(), Named("scalars")=trkFile.getScalarNames(), Named("streamlineProperties")=trkFile.getStreamlinePropertyNames());
 END_RCPP
 }
 
@@ -256,29 +318,61 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP trkLengths (SEXP _trkPath, SEXP _indices)
+RcppExport SEXP trkLabelIndexMemory (SEXP _pointer)
+{
+BEGIN_RCPP
+    // Don't build the index just to report its size
+    XPtr<StreamlineLabelList> labelsPtr(_pointer);
+    if (!labelsPtr->isIndexed())
+        return R_NilValue;
+    return wrap(static_cast<double>(labelsPtr->indexMemory()));
+END_RCPP
+}
+
+RcppExport SEXP trkLengths (SEXP _trkPath, SEXP _indices, SEXP _decode, SEXP _threads)
 {
 BEGIN_RCPP
-    BasicTrackvisDataSource trkFile(as<std::string>(_trkPath));
-    Pipeline<Streamline> pipeline(&trkFile);
     int_vector indices = as<int_vector>(_indices);
-    std::transform(indices.begin(), indices.end(), indices.begin(), decrement<int,int>);
-    pipeline.setSubset(indices);
     
-    StreamlineLengthsDataSink *sink = new StreamlineLengthsDataSink;
-    pipeline.addSink(sink);
+    // Decoding each streamline is slower, but gives reference values for the stored-point calculation
+    if (as<bool>(_decode))
+    {
+        BasicTrackvisDataSource trkFile(as<std::string>(_trkPath));
+        Pipeline<Streamline> pipeline(&trkFile);
+        std::transform(indices.begin(), indices.end(), indices.begin(), decrement<int,int>);
+        pipeline.setSubset(indices);
+        
+        StreamlineLengthsDataSink *sink = new StreamlineLengthsDataSink;
+        pipeline.addSink(sink);
+        
+        pipeline.run();
+        return wrap(sink->getLengths());
+    }
     
-    pipeline.run();
+    MappedTrackvisDataSource trkFile(as<std::string>(_trkPath));
+    trkFile.setThreads(as<int>(_threads));
+    
+    // Lengths are returned in index order, as by a pipeline subset
+    std::vector<size_t> subset(indices.size());
+    for (size_t i=0; i<indices.size(); i++)
+    {
+        if (indices[i] < 1)
+            throw std::runtime_error("Streamline index is out of range");
+        subset[i] = indices[i] - 1;
+    }
+    std::sort(subset.begin(), subset.end());
     
-    return wrap(sink->getLengths());
+    return wrap(trkFile.getLengths(subset));
 END_RCPP
 }
 
-RcppExport SEXP trkMap (SEXP _trkPath, SEXP _indices, SEXP _imagePath, SEXP _scope, SEXP _normalise, SEXP _resultPath)
+RcppExport SEXP trkMap (SEXP _trkPath, SEXP _indices, SEXP _imagePath, SEXP _scope, SEXP _normalise, SEXP _resultPath, SEXP _datatype, SEXP _sparse, SEXP _threads)
 {
 BEGIN_RCPP
-    BasicTrackvisDataSource trkFile(as<std::string>(_trkPath));
+    MappedTrackvisDataSource trkFile(as<std::string>(_trkPath));
+    trkFile.setThreads(as<int>(_threads));
     Pipeline<Streamline> pipeline(&trkFile);
+    pipeline.setThreads(as<int>(_threads));
     int_vector indices = as<int_vector>(_indices);
     std::transform(indices.begin(), indices.end(), indices.begin(), decrement<int,int>);
     pipeline.setSubset(indices);
@@ -294,27 +388,180 @@ BEGIN_RCPP
     const Grid<3> &grid = trkFile.getGrid3D();
     std::copy(grid.dimensions().data(), grid.dimensions().data()+3, dims.begin());
     VisitationMapDataSink *map = new VisitationMapDataSink(dims, scope, as<bool>(_normalise));
+    map->setThreads(as<int>(_threads));
     pipeline.addSink(map);
     
     pipeline.run();
     
-    RNifti::NiftiImage reference(as<std::string>(_imagePath), false);
-    map->writeToNifti(reference, as<std::string>(_resultPath));
+    if (as<bool>(_sparse))
+        map->writeSparse(as<std::string>(_resultPath));
+    else
+    {
+        const std::string datatypeString = as<std::string>(_datatype);
+        int datatype = DT_FLOAT64;
+        if (datatypeString == "float")
+            datatype = DT_FLOAT32;
+        else if (datatypeString == "integer")
+            datatype = DT_UINT32;
+        
+        RNifti::NiftiImage reference(as<std::string>(_imagePath), false);
+        map->writeToNifti(reference, as<std::string>(_resultPath), datatype);
+    }
     
     return R_NilValue;
 END_RCPP
 }
 
-RcppExport SEXP trkMedian (SEXP _trkPath, SEXP _indices, SEXP _resultPath, SEXP _quantile)
+RcppExport SEXP trkConnectome (SEXP _trkPath, SEXP _indices, SEXP _parcellationPath, SEXP _edges, SEXP _scalarPath, SEXP _resultPath, SEXP _threads)
+{
+BEGIN_RCPP
+    MappedTrackvisDataSource trkFile(as<std::string>(_trkPath));
+    trkFile.setThreads(as<int>(_threads));
+    Pipeline<Streamline> pipeline(&trkFile);
+    pipeline.setThreads(as<int>(_threads));
+    int_vector indices = as<int_vector>(_indices);
+    std::transform(indices.begin(), indices.end(), indices.begin(), decrement<int,int>);
+    pipeline.setSubset(indices);
+    
+    // Images are reoriented to match the streamline grid, as in track()
+    const Grid<3> &grid = trkFile.getGrid3D();
+    const std::string gridOrientation = grid3DOrientation(grid);
+    RNifti::NiftiImage parcellationImage(as<std::string>(_parcellationPath));
+    parcellationImage.reorient(gridOrientation);
+    Array<int> *parcellation = getImageArray<int>(parcellationImage);
+    const std::vector<int> &dims = parcellation->getDimensions();
+    if (dims.size() != 3 || dims[0] != grid.dimensions()[0] || dims[1] != grid.dimensions()[1] || dims[2] != grid.dimensions()[2])
+    {
+        delete parcellation;
+        throw std::runtime_error("Parcellation image dimensions don't match the streamline grid");
+    }
+    
+    const ConnectomeDataSink::EdgeDefinition edges = (as<std::string>(_edges) == "traversal" ? ConnectomeDataSink::TraversalEdges : ConnectomeDataSink::EndpointEdges);
+    ConnectomeDataSink *connectome = new ConnectomeDataSink(*parcellation, edges);
+    delete parcellation;
+    pipeline.addSink(connectome);
+    
+    if (!Rf_isNull(_scalarPath))
+    {
+        RNifti::NiftiImage scalarImage(as<std::string>(_scalarPath));
+        scalarImage.reorient(gridOrientation);
+        Array<float> *scalars = getImageArray<float>(scalarImage);
+        connectome->setScalars(*scalars);
+        delete scalars;
+    }
+    
+    pipeline.run();
+    connectome->writeEdgeList(as<std::string>(_resultPath));
+    
+    return R_NilValue;
+END_RCPP
+}
+
+RcppExport SEXP trkSample (SEXP _trkPath, SEXP _indices, SEXP _imagePaths, SEXP _interpolation, SEXP _reduction, SEXP _resultPaths, SEXP _threads)
+{
+BEGIN_RCPP
+    MappedTrackvisDataSource trkFile(as<std::string>(_trkPath));
+    trkFile.setThreads(as<int>(_threads));
+    Pipeline<Streamline> pipeline(&trkFile);
+    pipeline.setThreads(as<int>(_threads));
+    int_vector indices = as<int_vector>(_indices);
+    std::transform(indices.begin(), indices.end(), indices.begin(), decrement<int,int>);
+    pipeline.setSubset(indices);
+    
+    // Images are reoriented to match the streamline grid, as in track()
+    const Grid<3> &grid = trkFile.getGrid3D();
+    const std::string gridOrientation = grid3DOrientation(grid);
+    const str_vector imagePaths = as<str_vector>(_imagePaths);
+    std::vector< Array<float> > images;
+    RNifti::NiftiImage reference;
+    for (size_t i=0; i<imagePaths.size(); i++)
+    {
+        RNifti::NiftiImage image(imagePaths[i]);
+        image.reorient(gridOrientation);
+        if (i == 0)
+            reference = image;
+        Array<float> *data = getImageArray<float>(image);
+        images.push_back(*data);
+        delete data;
+        
+        const std::vector<int> &dims = images.back().getDimensions();
+        if (dims.size() != 3 || dims[0] != grid.dimensions()[0] || dims[1] != grid.dimensions()[1] || dims[2] != grid.dimensions()[2])
+            throw std::runtime_error("Sampled image dimensions don't match the streamline grid");
+    }
+    
+    const std::string interpolationString = as<std::string>(_interpolation);
+    const std::string reductionString = as<std::string>(_reduction);
+    const ScalarSamplingDataSink::Interpolation interpolation = (interpolationString == "trilinear" ? ScalarSamplingDataSink::TrilinearInterpolation : ScalarSamplingDataSink::NearestInterpolation);
+    ScalarSamplingDataSink::Reduction reduction = ScalarSamplingDataSink::StreamlineMeanReduction;
+    if (reductionString == "profile")
+        reduction = ScalarSamplingDataSink::ProfileReduction;
+    else if (reductionString == "voxel")
+        reduction = ScalarSamplingDataSink::VoxelReduction;
+    
+    ScalarSamplingDataSink *sampler = new ScalarSamplingDataSink(images, interpolation, reduction);
+    sampler->setThreads(as<int>(_threads));
+    pipeline.addSink(sampler);
+    pipeline.run();
+    
+    const int nImages = static_cast<int>(sampler->nImages());
+    if (reduction == ScalarSamplingDataSink::StreamlineMeanReduction)
+    {
+        const int nStreamlines = static_cast<int>(sampler->getMeans(0).size());
+        NumericMatrix result(nStreamlines, nImages);
+        for (int j=0; j<nImages; j++)
+            std::copy(sampler->getMeans(j).begin(), sampler->getMeans(j).end(), result.begin() + j * nStreamlines);
+        return result;
+    }
+    else if (reduction == ScalarSamplingDataSink::ProfileReduction)
+    {
+        std::vector<double> profileMeans;
+        std::vector<size_t> profileCounts;
+        const int seed = static_cast<int>(sampler->getProfile(0, profileMeans, profileCounts));
+        const int nPositions = static_cast<int>(profileMeans.size());
+        NumericMatrix means(nPositions, nImages);
+        IntegerMatrix counts(nPositions, nImages);
+        for (int j=0; j<nImages; j++)
+        {
+            if (j > 0)
+                sampler->getProfile(j, profileMeans, profileCounts);
+            std::copy(profileMeans.begin(), profileMeans.end(), means.begin() + j * nPositions);
+            std::copy(profileCounts.begin(), profileCounts.end(), counts.begin() + j * nPositions);
+        }
+        
+        IntegerVector positions(nPositions);
+        for (int i=0; i<nPositions; i++)
+            positions[i] = i - seed;
+        return List::create(Named("positions")=positions, Named("means")=means, Named("counts")=counts);
+    }
+    else
+    {
+        // Voxelwise means are written in the (reoriented) space of the first image
+        const str_vector resultPaths = as<str_vector>(_resultPaths);
+        if (static_cast<int>(resultPaths.size()) != nImages)
+            throw std::runtime_error("One result path is needed for each sampled image");
+        std::vector<double> voxelMeans;
+        for (int j=0; j<nImages; j++)
+        {
+            sampler->getVoxelMeans(j, voxelMeans);
+            RNifti::NiftiImage image = reference;
+            image.replaceData(voxelMeans, DT_FLOAT64);
+            image.toFile(resultPaths[j]);
+        }
+        return R_NilValue;
+    }
+END_RCPP
+}
+
+RcppExport SEXP trkMedian (SEXP _trkPath, SEXP _indices, SEXP _resultPath, SEXP _quantile, SEXP _approximate)
 {
 BEGIN_RCPP
-    // Block size must match number of streamlines, as a running median can't be calculated
     BasicTrackvisDataSource trkFile(as<std::string>(_trkPath));
-    Pipeline<Streamline> pipeline(&trkFile, trkFile.nStreamlines());
+    Pipeline<Streamline> pipeline(&trkFile);
     int_vector indices = as<int_vector>(_indices);
     std::transform(indices.begin(), indices.end(), indices.begin(), decrement<int,int>);
     pipeline.setSubset(indices);
     MedianTrackvisDataSink *medianFile = new MedianTrackvisDataSink(as<std::string>(_resultPath), trkFile.getGrid3D(), as<double>(_quantile));
+    medianFile->setApproximate(as<bool>(_approximate));
     pipeline.addSink(medianFile);
     
     pipeline.run();
@@ -323,18 +570,21 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP trkTruncate (SEXP _trkPath, SEXP _indices, SEXP _resultPath, SEXP _leftLength, SEXP _rightLength)
+RcppExport SEXP trkTruncate (SEXP _trkPath, SEXP _indices, SEXP _resultPath, SEXP _leftLength, SEXP _rightLength, SEXP _threads)
 {
 BEGIN_RCPP
-    // BasicTrackvisDataSource does not read labels, but when truncating they may not be preserved anyway
-    BasicTrackvisDataSource trkFile(as<std::string>(_trkPath));
+    // Labels are not read here, but when truncating they may not be preserved anyway
+    MappedTrackvisDataSource trkFile(as<std::string>(_trkPath));
+    trkFile.setThreads(as<int>(_threads));
     Pipeline<Streamline> pipeline(&trkFile);
+    pipeline.setThreads(as<int>(_threads));
     int_vector indices = as<int_vector>(_indices);
     std::transform(indices.begin(), indices.end(), indices.begin(), decrement<int,int>);
     pipeline.setSubset(indices);
     StreamlineTruncator *truncator = new StreamlineTruncator(as<double>(_leftLength), as<double>(_rightLength));
     pipeline.addManipulator(truncator);
     BasicTrackvisDataSink *resultFile = new BasicTrackvisDataSink(as<std::string>(_resultPath), trkFile.getGrid3D());
+    resultFile->setFields(trkFile.getScalarNames(), trkFile.getStreamlinePropertyNames());
     pipeline.addSink(resultFile);
     
     pipeline.run();
@@ -343,17 +593,51 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP trkCreate (SEXP _trkPath, SEXP _mask)
+RcppExport SEXP trkCompress (SEXP _trkPath, SEXP _indices, SEXP _resultPath, SEXP _tolerance, SEXP _threads)
+{
+BEGIN_RCPP
+    MappedTrackvisDataSource trkFile(as<std::string>(_trkPath));
+    trkFile.setThreads(as<int>(_threads));
+    Pipeline<Streamline> pipeline(&trkFile);
+    pipeline.setThreads(as<int>(_threads));
+    int_vector indices = as<int_vector>(_indices);
+    std::transform(indices.begin(), indices.end(), indices.begin(), decrement<int,int>);
+    pipeline.setSubset(indices);
+    StreamlineSimplifier *simplifier = new StreamlineSimplifier(as<double>(_tolerance));
+    pipeline.addManipulator(simplifier);
+    BasicTrackvisDataSink *resultFile = new BasicTrackvisDataSink(as<std::string>(_resultPath), trkFile.getGrid3D());
+    resultFile->setFields(trkFile.getScalarNames(), trkFile.getStreamlinePropertyNames());
+    pipeline.addSink(resultFile);
+    
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pipeline.run();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    const double nStreamlines = static_cast<double>(simplifier->getStreamlineCount());
+    return List::create(Named("streamlines")=nStreamlines, Named("pointsBefore")=static_cast<double>(simplifier->getPointsBefore()), Named("pointsAfter")=static_cast<double>(simplifier->getPointsAfter()), Named("ratio")=simplifier->getCompressionRatio(), Named("seconds")=seconds, Named("throughput")=(seconds > 0.0 ? nStreamlines / seconds : R_PosInf));
+END_RCPP
+}
+
+RcppExport SEXP trkCreate (SEXP _trkPath, SEXP _mask, SEXP _scalarNames, SEXP _propertyNames)
 {
 BEGIN_RCPP
     RNifti::NiftiImage mask(_mask);
     BasicTrackvisDataSink *sink = new BasicTrackvisDataSink(as<std::string>(_trkPath), getGrid3D(mask));
+    try
+    {
+        sink->setFields(as<str_vector>(_scalarNames), as<str_vector>(_propertyNames));
+    }
+    catch (...)
+    {
+        delete sink;
+        throw;
+    }
     XPtr<BasicTrackvisDataSink> sinkPtr(sink);
     return sinkPtr;
 END_RCPP
 }
 
-RcppExport SEXP trkAppend (SEXP _sink, SEXP _points, SEXP _seedIndex, SEXP _pointType, SEXP _fixedSpacing)
+RcppExport SEXP trkAppend (SEXP _sink, SEXP _points, SEXP _seedIndex, SEXP _pointType, SEXP _fixedSpacing, SEXP _scalars, SEXP _properties)
 {
 BEGIN_RCPP
     XPtr<BasicTrackvisDataSink> sinkPtr(_sink);
@@ -382,6 +666,33 @@ BEGIN_RCPP
     }
     
     Streamline streamline(leftPoints, rightPoints, pointType, sink->getGrid3D().spacings(), as<bool>(_fixedSpacing));
+    
+    // Scalars are given with one row per point, in the same order as the points
+    if (!Rf_isNull(_scalars))
+    {
+        Rcpp::NumericMatrix scalarsR(_scalars);
+        if (scalarsR.rows() != pointsR.rows())
+            throw std::runtime_error("Scalar matrix should have one row per point");
+        const int nScalars = scalarsR.cols();
+        std::vector<float> leftScalars, rightScalars;
+        for (int i=seedIndex; i>=0; i--)
+        {
+            for (int j=0; j<nScalars; j++)
+                leftScalars.push_back(static_cast<float>(scalarsR(i,j)));
+        }
+        for (int i=seedIndex; i<pointsR.rows(); i++)
+        {
+            for (int j=0; j<nScalars; j++)
+                rightScalars.push_back(static_cast<float>(scalarsR(i,j)));
+        }
+        streamline.setScalars(nScalars, leftScalars, rightScalars);
+    }
+    if (!Rf_isNull(_properties))
+    {
+        const std::vector<double> properties = as< std::vector<double> >(_properties);
+        streamline.setProperties(std::vector<float>(properties.begin(), properties.end()));
+    }
+    
     std::list<Streamline> list;
     list.push_back(streamline);
     sink->setup(1, list.begin(), list.end());
@@ -393,9 +704,21 @@ END_RCPP
 
 RcppExport SEXP trkClose (SEXP _sink)
 {
+BEGIN_RCPP
     XPtr<BasicTrackvisDataSink> sinkPtr(_sink);
     BasicTrackvisDataSink *sink = sinkPtr;
-    sink->done();
+    
+    // Write failures are reported, but the sink is released either way
+    try
+    {
+        sink->done();
+    }
+    catch (...)
+    {
+        sinkPtr.release();
+        throw;
+    }
     sinkPtr.release();
     return R_NilValue;
+END_RCPP
 }